@@ -1,80 +1,650 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// Memory-mapped input and worker threads are available on POSIX systems
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP 1
+#define HAVE_THREADS 1
+#define HAVE_UNISTD 1
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Vectorized symbol check is compiled for x86 with GCC-compatible compilers and is chosen
+// at run time by CPU features
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Automata are compiled into native code for x86-64 on systems with mmap
+#if defined(HAVE_MMAP) && defined(__x86_64__)
+#define HAVE_JIT 1
+#endif
+
 #define MAX_LINE_LENGTH 4096
-#define MAX_STATES 256
 #define MAX_SYMBOLS 256
 
+// Amount of input given to a worker at once
+#define CHUNK_SIZE (1 << 20)
+
+// Number of processed chunks that may wait to be written, per worker
+#define CHUNKS_PER_WORKER 4
+
+// Number of records simulated in lockstep and number of records split out of input at once
+#define BATCH_LANES 8
+#define BATCH_RECORDS 256
+
+// Records at least this long are split between threads. States met by every part are followed
+// in blocks that grow from the first size to the last one
+#define HUGE_RECORD_SIZE (16 * CHUNK_SIZE)
+#define SPECULATION_FIRST_BLOCK 64
+#define SPECULATION_BLOCK 4096
+
+// Automata with at most this many states are also run by moving every state at once with shuffles
+// Records run this way are checked for deciding states after every ENUM_BLOCK bytes
+#define ENUM_STATES 16
+#define ENUM_BLOCK 64
+
+// Sets of at most PRODUCT_MAX_AUTOMATA automata are run as one product automaton if it has
+// at most PRODUCT_MAX_STATES states, other sets run every automaton over each batch of records
+#define PRODUCT_MAX_AUTOMATA 64
+#define PRODUCT_MAX_STATES (1 << 16)
+
+// States built lazily are kept in a cache of at most LAZY_MAX_STATES states that is emptied when
+// it is full. Cache that is emptied before input gives LAZY_MIN_BYTES_PER_STATE bytes for every
+// state it holds is thrashing and is not used anymore
+#define LAZY_MAX_STATES 4096
+#define LAZY_MIN_BYTES_PER_STATE 10
+
+// Nondeterministic automata are made deterministic at load time unless the result has more than
+// SUBSET_MAX_STATES states. States of the result are named after at most SUBSET_NAME_STATES members
+#define SUBSET_MAX_STATES (1 << 20)
+#define SUBSET_NAME_STATES 8
+
+// Regular expressions may nest at most REGEX_MAX_DEPTH groups and repeat at most REGEX_MAX_REPEAT times
+#define REGEX_MAX_DEPTH 1000
+#define REGEX_MAX_REPEAT 1000
+
+// Nested repetitions multiply, so automaton of regular expression is limited to REGEX_MAX_SIZE
+// states and as many transitions
+#define REGEX_MAX_SIZE (1 << 20)
+
+// Version of syntax of regular expressions, it is kept with cached automata and raised whenever
+// some expression is read differently, so that automata cached by older versions are not used.
+// Version 2 reads \n as line end, rejects unknown escapes and keeps line ends in sets of scan mode
+#define REGEX_SYNTAX_VERSION 2
+
+// Native code of a state compares the byte with every symbol when there are at most this many,
+// otherwise it jumps through a table indexed by byte class
+#define NATIVE_CHAIN_SYMBOLS 8
+
+// Binary file of compiled automaton: magic string, version of layout and alignment of sections
+#define BINARY_MAGIC "DFSMBIN"
+#define BINARY_VERSION 4
+#define BINARY_ALIGN 64
+
+// Automaton can be built into the program: header written with -g is given to compiler as
+// -DDFSM_BUILTIN_HEADER='"automaton.h"' and is chosen at run time with -b
+#ifdef DFSM_BUILTIN_HEADER
+#include DFSM_BUILTIN_HEADER
+#endif
+
+// Output modes: every result, only accepted lines or only number of results of each kind
+#define OUTPUT_ALL 0
+#define OUTPUT_ACCEPTED 1
+#define OUTPUT_COUNTS 2
+
+// Pool that keeps many strings packed one after another in a single block
+typedef struct {
+	// Block of NUL-terminated strings
+	char * data;
+	
+	// Number of used bytes in data
+	size_t length;
+	
+	// Number of allocated bytes in data
+	size_t capacity;
+} StringPool;
+
+// Growable block of bytes
+typedef struct {
+	// Stored bytes
+	char * data;
+	
+	// Number of used bytes in data
+	size_t length;
+	
+	// Number of allocated bytes in data
+	size_t capacity;
+} ByteBuffer;
+
+// Output stage that formats results into a reusable buffer and writes it in large blocks
+typedef struct {
+	// One of OUTPUT_* modes
+	int mode;
+	
+	// Formatted results that are not written yet
+	ByteBuffer buffer;
+	
+	// Number of results of each kind: accepted, rejected, wrong symbol. Matches are counted
+	// as accepted results in scan mode
+	long counts[3];
+	
+	// Set when ends of matches in a stream are written instead of results of records
+	int scan;
+	
+	// Number of automata in multi-automaton mode, 0 otherwise
+	int automataNum;
+	
+	// Number of records accepted by every automaton of multi-automaton mode,
+	// followed by number of records accepted by none
+	long * acceptedBy;
+} ResultWriter;
+
 // Automaton structure that holds all the data related to this DFA
 typedef struct {
-	// This is a set of possible states
-	char * statesNames[MAX_STATES];
+	// Storage for names of states
+	StringPool namePool;
+	
+	// This is a set of possible states, as offsets of their names in namePool
+	size_t * statesNames;
 	
 	// Number of states total
 	int statesNum;
 	
+	// Number of allocated entries in statesNames and finishState
+	int statesCapacity;
+	
+	// Open addressing hash index over statesNames, empty slots hold -1
+	int * stateHash;
+	
+	// Number of slots in stateHash, always a power of two
+	int stateHashSize;
+	
 	// Set of finishing states
-	int finishState[MAX_STATES];
+	char * finishState;
 	
 	// Index of start state
 	int startStateIndex;
 	
-	// Transition symbols
+	// Transition symbols. Symbols are unique bytes, so there are never more than MAX_SYMBOLS of them
 	char transitions[MAX_SYMBOLS];
 	
 	// Number of transition symbols
 	int transitionsNum;
 	
-	// 2D array of transitions
-	int ** transitionTable;
+	// Flat array of statesNum * transitionsNum transitions, -1 for missing ones
+	int * transitionTable;
 } Automaton;
 
+// Nondeterministic automaton, possibly with epsilon transitions. Its states, start state,
+// finishing states and symbols are kept in an Automaton without transition table
+typedef struct {
+	Automaton states;
+	
+	// Transitions in order they were added: source state, index of symbol or -1 for
+	// epsilon transition, and target state
+	int * edgeFrom;
+	int * edgeSymbol;
+	int * edgeTo;
+	int edgesNum;
+	int edgesCapacity;
+	
+	// Set by SortNfaEdges: transitions of state s are from firstEdge[s] to firstEdge[s + 1]
+	int * firstEdge;
+	
+	// Index of symbol of every byte, -1 for bytes that are not symbols. A symbol of automaton
+	// made of regular expression stands for every byte of its class
+	int byteSymbol[256];
+} Nfa;
+
+// Execution form of an automaton, built once after it is loaded
+// Input bytes that behave the same way in every state form a class, and every state owns
+// a row of next states indexed by class of the input byte
+// Table entries are as narrow as the number of states allows
+typedef struct {
+	// Number of rows in the table (automaton states plus dead and wrong symbol states)
+	int statesNum;
+	
+	// Index of start state
+	int startState;
+	
+	// State for missing transitions, it loops to itself on every known symbol
+	// It is always the one before last state, so simulation loops tell it and wrong symbol state
+	// from the rest with a single comparison
+	int deadState;
+	
+	// State for unknown symbols, it is never left once entered. It is always the last state
+	int wrongSymbolState;
+	
+	// First state that decides result: finishing states that loop to themselves on every symbol
+	// are placed right before dead state, so once simulation gets into one of states from
+	// this one to the last, only symbols of the rest of input have to be checked
+	int stopState;
+	
+	// Bitmap of finishing states, state s is bit s % 8 of byte s / 8
+	uint8_t * finishBits;
+	
+	// Marks bytes that belong to automaton symbol set
+	char symbolValid[256];
+	
+	// Symbol set as 16 x 16 bit matrix for vectorized check: bit h of symbolBitsLow[l]
+	// is set if byte h * 16 + l is a symbol, symbolBitsHigh does the same for h + 8
+	uint8_t symbolBitsLow[16];
+	uint8_t symbolBitsHigh[16];
+	
+	// Class of every byte. Class 0 holds bytes outside of symbol set, unless every byte is a symbol
+	uint8_t byteClass[256];
+	
+	// Number of byte classes
+	int classesNum;
+	
+	// For automata of at most ENUM_STATES states, ENUM_STATES bytes for every class:
+	// byte s is the state that state s goes to on bytes of the class. NULL for larger automata
+	uint8_t * statePermutations;
+	
+	// Rows are 2^rowShift entries long, the smallest power of two that fits every class,
+	// so the row of a state is found with a shift
+	int rowShift;
+	
+	// Size of one table entry in bytes: 1, 2 or 4
+	int stateWidth;
+	
+	// Flat array of statesNum rows of uint8_t, uint16_t or uint32_t transitions
+	void * table;
+	
+	// Names of automaton states (all but dead and wrong symbol ones), packed in one block
+	char * names;
+	
+	// Size of names block in bytes
+	size_t namesSize;
+	
+	// Offsets of state names in names block
+	uint64_t * nameOffsets;
+	
+	// Text the automaton is compiled from, e.g. regular expression, NULL if it is not known.
+	// It is saved in binary file, so cached automata are told apart by more than file name
+	const char * source;
+	size_t sourceSize;
+	
+	// Loaded binary file that all the arrays point into, NULL if they are allocated one by one
+	void * image;
+	
+	// Size of binary file in bytes
+	size_t imageSize;
+	
+	// Set for automaton built into the program, its arrays are not released
+	int builtin;
+	
+	// Generated code that runs records instead of table loops, NULL if there is none.
+	// It gets record bounds and returns the same results as ProcessString
+	int (* matchRecord)(const unsigned char * str, const unsigned char * end);
+	
+	// Native code made by CompileNative, NULL if there is none
+	void * nativeCode;
+	
+	// Size of native code in bytes
+	size_t nativeSize;
+} CompiledAutomaton;
+
+// Cache of states of a deterministic automaton that are built the first time input reaches them.
+// A state is known by its key of 32-bit words, e.g. tuple of states of other automata, and
+// the engine that owns the cache tells next key and accepting set of a key
+typedef struct {
+	// Key of the state that state with 'key' goes to on bytes of 'byteClass', returns its length.
+	// 'scratch' is work space of scratchSize bytes that belongs to the cache
+	int (* next)(const void * engine, void * scratch, const uint32_t * key, int keyLength, int byteClass, uint32_t * nextKey);
+	
+	// Marks accepting sets of a state in 'accepted' words
+	void (* accepting)(const void * engine, const uint32_t * key, int keyLength, uint64_t * accepted);
+	const void * engine;
+	
+	// Class of every byte
+	uint8_t byteClass[256];
+	int classesNum;
+	
+	// Number of words in a set of accepting sets and the largest key length
+	int acceptWords;
+	int maxKeyLength;
+	
+	// Key of the start state and key of the state that nothing is accepted from
+	uint32_t * startKey;
+	int startKeyLength;
+	uint32_t * sinkKey;
+	int sinkKeyLength;
+	
+	// Number of cached states. Sink state is always the first one
+	int statesNum;
+	int startState;
+	
+	// Flat array of LAZY_MAX_STATES rows of classesNum next states, -1 if not known yet
+	int32_t * table;
+	
+	// Accepting sets of every state
+	uint64_t * accepted;
+	
+	// Keys of states packed one after another, offset and length of key of every state
+	ByteBuffer keys;
+	size_t * keyOffsets;
+	int * keyLengths;
+	
+	// Open addressing table of LAZY_MAX_STATES * 2 state indexes
+	int * hash;
+	
+	// Space for the key being left and the next key
+	uint32_t * currentKey;
+	uint32_t * nextKey;
+	
+	// Work space of the engine
+	size_t scratchSize;
+	void * scratch;
+	
+	// Number of bytes run since cache was emptied
+	size_t bytesSinceFlush;
+	
+	// Set when cache is emptied too often to be of use
+	int thrashing;
+} LazyCache;
+
+// Caches of lazily built automaton shared by threads, every thread takes a cache that
+// no other thread uses, so caches are filled without locks
+typedef struct {
+	// Every created cache and marks of caches that are taken
+	LazyCache ** caches;
+	char * taken;
+	int cachesNum;
+	
+	// Parameters of new caches
+	LazyCache model;
+	
+#ifdef HAVE_THREADS
+	pthread_mutex_t lock;
+#endif
+} LazyPool;
+
+// Automata that classify records together in multi-automaton mode
+typedef struct {
+	// Compiled automata in order of the list they were loaded from
+	CompiledAutomaton * automata;
+	int automataNum;
+	
+	// Number of 64-bit words in a set of automata
+	int wordsNum;
+	
+	// Product automaton whose states are tuples of states of all automata, it has no table
+	// when automata are run one after another
+	int productStatesNum;
+	int productStart;
+	
+	// Product state that no automaton can accept from, every hopeless tuple is merged into it
+	int productSink;
+	
+	// Class of every byte: bytes of a class are in the same class of every automaton
+	uint8_t productClass[256];
+	int productClassesNum;
+	
+	// Some byte of every class
+	uint8_t productClassByte[256];
+	
+	// Flat array of productStatesNum rows of productClassesNum next states
+	uint32_t * productTable;
+	
+	// Set of accepting automata for every product state
+	uint64_t * productAccepted;
+	
+	// Caches of product states that are built lazily when product is too large to be built
+	// at once, NULL if the product is built
+	LazyPool * lazyProduct;
+} AutomatonSet;
+
+// What records are classified with: a single automaton or a set of them
+typedef struct {
+	// Automaton of single automaton mode, NULL in multi-automaton mode
+	const CompiledAutomaton * automaton;
+	
+	// Automata of multi-automaton mode, NULL in single automaton mode
+	const AutomatonSet * set;
+	
+	// Caches of automaton built lazily from nondeterministic one, used instead of 'automaton'
+	// when it is not NULL
+	LazyPool * lazyAutomaton;
+} Classifier;
+
+// Header of binary file of compiled automaton. Sections follow it at offsets
+// aligned to BINARY_ALIGN, so the file is used in place after it is mapped into memory
+typedef struct {
+	// BINARY_MAGIC
+	char magic[8];
+	
+	// BINARY_VERSION
+	uint32_t version;
+	
+	// Always 1 in native byte order, tells files written on machines with other byte order
+	uint32_t byteOrder;
+	
+	// Fields of CompiledAutomaton
+	uint32_t statesNum;
+	uint32_t startState;
+	uint32_t deadState;
+	uint32_t wrongSymbolState;
+	uint32_t stateWidth;
+	uint32_t stopState;
+	uint32_t classesNum;
+	uint32_t rowShift;
+	
+	// Offsets of sections from the beginning of file
+	uint64_t tableOffset;
+	uint64_t finishOffset;
+	uint64_t nameOffsetsOffset;
+	uint64_t namesOffset;
+	uint64_t sourceOffset;
+	
+	// Size of names section, of source section and of the whole file
+	uint64_t namesSize;
+	uint64_t sourceSize;
+	uint64_t fileSize;
+	
+	// Symbol set and classes of bytes
+	uint8_t symbolValid[256];
+	uint8_t byteClass[256];
+} BinaryHeader;
+
 // This function loads a string from file and stores it in temporary buffer
+// The buffer grows to fit lines of any length
 // It returns only non-empty strings
 // It outputs NULL if file ended and pointer to string if something was read
-const char * GetLine(FILE * f) {
-	static char line[MAX_LINE_LENGTH];
+char * GetLine(FILE * f) {
+	static char * line = NULL;
+	static size_t capacity = 0;
+	size_t length;
 	
 	// We need to load a string from file that begins from anything besides
 	// \n - newline character
 	// \0 - file end (presumably)
 	// # - comment symbol
 	do {
-		// If we could not load string, it seems like we stumbled upon file name
-		if (fgets(line, MAX_LINE_LENGTH, f) == NULL)
+		int readAnything = 0;
+		length = 0;
+		
+		// Read line piece by piece until we meet newline or file end
+		for (;;) {
+			if (capacity - length < 2) {
+				size_t newCapacity = capacity == 0 ? MAX_LINE_LENGTH : capacity * 2;
+				char * newLine = (char *) realloc(line, newCapacity);
+				if (newLine == NULL) {
+					fprintf(stderr, "Not enough memory for line buffer!\n");
+					return NULL;
+				}
+				line = newLine;
+				capacity = newCapacity;
+			}
+			
+			if (fgets(line + length, capacity - length, f) == NULL)
+				break;
+			readAnything = 1;
+			
+			size_t piece = strlen(line + length);
+			length += piece;
+			if (piece == 0 || line[length - 1] == '\n')
+				break;
+		}
+		
+		// If we could not load anything, file has ended
+		if (!readAnything)
 			return NULL;
 		
-		// Repeat until we got a string starting from something other than \n, \0 and # and
-		// end of file was not reached
-	} while (!feof(f) && (line[0] == '\0' || line[0] == '\n' || line[0] == '#'));
-	
-	// If there is an end, no string received
-	if (feof(f))
-		return NULL;
+		// Repeat until we got a string starting from something other than \n, \0 and #
+	} while (line[0] == '\0' || line[0] == '\n' || line[0] == '#');
 	
-	// We need to cut last '\n' symbol
-	int nextlinePos = strlen(line) - 1;
-	if (nextlinePos <= 0)
-		return NULL; // Should not get here
-	if (line[nextlinePos] == '\n')
-		line[nextlinePos] = '\0';
+	// We need to cut last '\n' symbol. Last line of file may have none
+	if (line[length - 1] == '\n')
+		line[length - 1] = '\0';
 	
 	return line;
 }
 
+// This function copies a string to the pool
+// Returns offset of the copy or (size_t) -1 on failure
+size_t PoolAdd(StringPool * pool, const char * str) {
+	size_t size = strlen(str) + 1;
+	
+	if (pool->capacity - pool->length < size) {
+		size_t newCapacity = pool->capacity == 0 ? MAX_LINE_LENGTH : pool->capacity;
+		while (newCapacity - pool->length < size)
+			newCapacity *= 2;
+		
+		char * newData = (char *) realloc(pool->data, newCapacity);
+		if (newData == NULL)
+			return (size_t) -1;
+		pool->data = newData;
+		pool->capacity = newCapacity;
+	}
+	
+	size_t offset = pool->length;
+	memcpy(pool->data + offset, str, size);
+	pool->length += size;
+	
+	return offset;
+}
+
+// This function returns name of state by its index
+const char * StateName(const Automaton * a, int idx) {
+	return a->namePool.data + a->statesNames[idx];
+}
+
+// This function makes room for 'size' more bytes in the buffer
+// Returns 0 on success, 1 on failure
+int BufferReserve(ByteBuffer * buffer, size_t size) {
+	if (buffer->capacity - buffer->length < size) {
+		size_t newCapacity = buffer->capacity == 0 ? MAX_LINE_LENGTH : buffer->capacity;
+		while (newCapacity - buffer->length < size)
+			newCapacity *= 2;
+		
+		char * newData = (char *) realloc(buffer->data, newCapacity);
+		if (newData == NULL)
+			return 1;
+		buffer->data = newData;
+		buffer->capacity = newCapacity;
+	}
+	
+	return 0;
+}
+
+// This function appends bytes to the buffer, growing it when needed
+// Returns 0 on success, 1 on failure
+int BufferAppend(ByteBuffer * buffer, const char * bytes, size_t size) {
+	if (BufferReserve(buffer, size))
+		return 1;
+	
+	memcpy(buffer->data + buffer->length, bytes, size);
+	buffer->length += size;
+	return 0;
+}
+
+// This function computes FNV-1a hash of a string
+unsigned int HashString(const char * str) {
+	unsigned int hash = 2166136261u;
+	
+	while (*str != '\0') {
+		hash ^= (unsigned char) *str++;
+		hash *= 16777619u;
+	}
+	
+	return hash;
+}
+
+// This function computes FNV-1a hash of a key of 32-bit words
+uint64_t HashKey(const uint32_t * key, int keyLength) {
+	uint64_t hash = 14695981039346656037ull ^ (uint64_t) keyLength;
+	int i;
+	
+	for (i = 0; i < keyLength; i++)
+		hash = (hash ^ key[i]) * 1099511628211ull;
+	
+	return hash;
+}
+
+// This function returns slot of state hash index that holds 'state' or empty slot
+// where it should be inserted
+int StateHashSlot(Automaton * a, const char * state) {
+	int mask = a->stateHashSize - 1;
+	int slot = HashString(state) & mask;
+	
+	// Linear probing until we find matching or empty slot
+	while (a->stateHash[slot] != -1 && strcmp(state, StateName(a, a->stateHash[slot])) != 0)
+		slot = (slot + 1) & mask;
+	
+	return slot;
+}
+
+// This function puts last added state into hash index, growing it when it is half full
+// Returns 0 on success, 1 if state with the same name is already indexed, 2 if there is
+// not enough memory
+int IndexState(Automaton * a) {
+	int i;
+	
+	if (2 * a->statesNum > a->stateHashSize) {
+		int newSize = a->stateHashSize == 0 ? 64 : a->stateHashSize * 2;
+		int * newHash = (int *) malloc(newSize * sizeof(int));
+		if (newHash == NULL)
+			return 2;
+		
+		free(a->stateHash);
+		a->stateHashSize = newSize;
+		a->stateHash = newHash;
+		for (i = 0; i < a->stateHashSize; i++)
+			a->stateHash[i] = -1;
+		
+		// Reinsert all states except the last one
+		for (i = 0; i < a->statesNum - 1; i++)
+			a->stateHash[StateHashSlot(a, StateName(a, i))] = i;
+	}
+	
+	int last = a->statesNum - 1;
+	int slot = StateHashSlot(a, StateName(a, last));
+	if (a->stateHash[slot] != -1)
+		return 1;
+	
+	a->stateHash[slot] = last;
+	return 0;
+}
+
 // This function returns index of state or -1 if not found
 // Would never return a->statesNum or larger
 int StateToIdx(Automaton * a, const char * state) {
-	int i;
-	
-	// Iterate through all states and find the one with exact match with 'state'
-	for (i = 0; i < a->statesNum; i++)
-		if (strcmp(state, a->statesNames[i]) == 0)
-			return i;
+	if (a->stateHashSize == 0)
+		return -1;
 	
-	// 'state' is not found
-	return -1;
+	// Empty slot means that 'state' is not found
+	return a->stateHash[StateHashSlot(a, state)];
 }
 
 // Thus function returns index of transition symbol or -1 if not found
@@ -91,87 +661,136 @@ int TransitionToIdx(Automaton * a, const char transition) {
 	return -1;
 }
 
-// This function reads a word from string and returns pointer to the next word
+// This function cuts next word out of string in place and moves 'str' to the rest of it
 // If string is emptied, returns NULL
-const char * ReadWord(const char * str, char * word) {
-	// Try to read word
-	if (sscanf(str, "%s", word) != 1)
-		return NULL;
+char * ReadWord(char ** str) {
+	char * strPtr = *str;
 	
-	// Word is read successfully. Now we need to shift our pointer to next word (or to the end)
-	const char * strPtr = str;
-	
-	// Skip to the next word
-	while (*strPtr != ' ' && *strPtr != '\0')
+	// Skip spaces
+	while (isspace((unsigned char) *strPtr))
 		strPtr++;
 	
-	// Skip spaces
-	while (*strPtr == ' ')
+	if (*strPtr == '\0')
+		return NULL;
+	
+	// Skip to the end of the word and terminate it
+	char * word = strPtr;
+	while (*strPtr != '\0' && !isspace((unsigned char) *strPtr))
 		strPtr++;
 	
+	if (*strPtr != '\0')
+		*strPtr++ = '\0';
+	
 	// It is a beginning of the next word or end of string
-	return strPtr;
+	*str = strPtr;
+	return word;
 }
 
-// This function loads automaton from file
+// This function appends a state to automaton, growing storage when needed
 // Returns 0 on success, 1 on failure
-int LoadAutomaton(Automaton * a, const char path[]) {
-	// Initialize numbers 
-	a->statesNum = 0;
-	a->transitionsNum = 0;
-	
-	FILE * f;
-	f = fopen(path, "r");
+int AddState(Automaton * a, const char * name) {
+	if (a->statesNum == a->statesCapacity) {
+		int newCapacity = a->statesCapacity == 0 ? 64 : a->statesCapacity * 2;
+		size_t * newNames = (size_t *) realloc(a->statesNames, newCapacity * sizeof(size_t));
+		if (newNames == NULL)
+			return 1;
+		a->statesNames = newNames;
+		
+		char * newFinish = (char *) realloc(a->finishState, newCapacity * sizeof(char));
+		if (newFinish == NULL)
+			return 1;
+		a->finishState = newFinish;
+		
+		a->statesCapacity = newCapacity;
+	}
 	
-	if (f == NULL) {
-		fprintf(stderr, "File not found or could not be opened: %s\n", path);
+	size_t offset = PoolAdd(&a->namePool, name);
+	if (offset == (size_t) -1)
 		return 1;
-	}
 	
+	a->statesNames[a->statesNum] = offset;
+	a->finishState[a->statesNum] = 0;
+	a->statesNum++;
+	
+	return 0;
+}
+
+// This function prepares automaton without states and symbols
+void InitAutomaton(Automaton * a) {
+	a->statesNum = 0;
+	a->statesCapacity = 0;
+	a->namePool.data = NULL;
+	a->namePool.length = 0;
+	a->namePool.capacity = 0;
+	a->statesNames = NULL;
+	a->finishState = NULL;
+	a->transitionTable = NULL;
+	a->transitionsNum = 0;
+	a->stateHash = NULL;
+	a->stateHashSize = 0;
+}
+
+// This function reads start state, states, symbols and finishing states of automaton,
+// the lines that deterministic and nondeterministic automata files share
+// Returns 0 on success, 1 on failure
+int ReadAutomatonHeader(Automaton * a, FILE * f) {
 	// Load initial state
-	char initialState[MAX_LINE_LENGTH];
 	const char * initialStateStr = GetLine(f);
 	if (initialStateStr == NULL) {
 		fprintf(stderr, "Cannot read initial state!\n");
-		fclose(f);
+		return 1;
+	}
+	// Line buffer is reused for the next lines
+	char * initialState = (char *) malloc(strlen(initialStateStr) + 1);
+	if (initialState == NULL) {
+		fprintf(stderr, "Not enough memory for initial state!\n");
 		return 1;
 	}
 	strcpy(initialState, initialStateStr);
 	
 	// Load states string
-	const char * states = GetLine(f);
+	char * states = GetLine(f);
 	if (states == NULL) {
 		fprintf(stderr, "Cannot read set of states!\n");
-		fclose(f);
-		return 1;
+		goto fail;
 	}
 	
 	// Load possible states and assign them to numbers
-	char curState[MAX_LINE_LENGTH];
-	while ((states = ReadWord(states, curState)) != NULL) {
-		a->statesNames[a->statesNum] = (char *) malloc(MAX_LINE_LENGTH * sizeof(char));
-		strcpy(a->statesNames[a->statesNum], curState);
-		a->statesNum++;
+	char * curState;
+	while ((curState = ReadWord(&states)) != NULL) {
+		if (AddState(a, curState)) {
+			fprintf(stderr, "Cannot store state %s!\n", curState);
+			goto fail;
+		}
+		
+		int res = IndexState(a);
+		if (res == 2) {
+			fprintf(stderr, "Not enough memory for state %s!\n", curState);
+			goto fail;
+		}
+		if (res) {
+			fprintf(stderr, "Duplicated state: %s\n", curState);
+			goto fail;
+		}
 	}
 	
 	// Evaluate start state index
 	a->startStateIndex = StateToIdx(a, initialState);
 	if (a->startStateIndex == -1) {
 		fprintf(stderr, "Start state %s is not listed in states list!\n", initialState);
-		fclose(f);
-		return 1;
+		goto fail;
 	}
+	free(initialState);
 	
 	// Read symbol table
-	const char * transitions = GetLine(f);
+	char * transitions = GetLine(f);
 	if (transitions == NULL) {
 		fprintf(stderr, "Cannot read transition symbols!\n");
-		fclose(f);
 		return 1;
 	}
 	
-	char curSymbol[MAX_LINE_LENGTH];
-	while ((transitions = ReadWord(transitions, curSymbol)) != NULL) {
+	char * curSymbol;
+	while ((curSymbol = ReadWord(&transitions)) != NULL) {
 		char c = curSymbol[0];
 		
 		// check c for duplicates
@@ -179,7 +798,6 @@ int LoadAutomaton(Automaton * a, const char path[]) {
 		for (t = 0; t < a->transitionsNum; t++)
 			if (a->transitions[t] == c) {
 				fprintf(stderr, "Symbol %c occurs in symbol list twice!\n", c);
-				fclose(f);
 				return 1;
 			}
 		
@@ -188,68 +806,95 @@ int LoadAutomaton(Automaton * a, const char path[]) {
 	}
 	
 	// Read finish states
-	int i,j;
-	for (i = 0; i < a->statesNum; i++)
-		a->finishState[i] = 0;
-	
-	const char * finishStates = GetLine(f);
+	char * finishStates = GetLine(f);
 	if (finishStates == NULL) {
 		fprintf(stderr, "Cannot read set of finish states!\n");
-		fclose(f);
 		return 1;
 	}
 	
-	while ((finishStates = ReadWord(finishStates, curState)) != NULL) {
+	while ((curState = ReadWord(&finishStates)) != NULL) {
 		int idx = StateToIdx(a, curState);
 		if (idx == -1) {
 			fprintf(stderr, "Finishing state %s is not listed in states list!\n", curState);
-			fclose(f);
 			return 1;
 		}
 		
 		if (a->finishState[idx] == 1) {
 			fprintf(stderr, "Duplicated finishing state: %s\n", curState);
-			fclose(f);
 			return 1;
 		}
 		
 		a->finishState[idx] = 1;
 	}
 	
+	return 0;
+	
+fail:
+	free(initialState);
+	return 1;
+}
+
+// This function loads automaton from file
+// Returns 0 on success, 1 on failure
+int LoadAutomaton(Automaton * a, const char path[]) {
+	// Initialize numbers 
+	InitAutomaton(a);
+	
+	FILE * f;
+	f = fopen(path, "r");
+	
+	if (f == NULL) {
+		fprintf(stderr, "File not found or could not be opened: %s\n", path);
+		return 1;
+	}
+	
+	if (ReadAutomatonHeader(a, f)) {
+		fclose(f);
+		return 1;
+	}
+	
 	// Initialize transition table
-	a->transitionTable = (int **) malloc(a->statesNum * sizeof(int *));
-	for (i = 0; i < a->statesNum; i++) {
-		a->transitionTable[i] = (int *) malloc(a->transitionsNum * sizeof(int));
-		for (j = 0; j < a->transitionsNum; j++)
-			a->transitionTable[i][j] = -1;
+	size_t tableSize = (size_t) a->statesNum * a->transitionsNum;
+	a->transitionTable = (int *) malloc(tableSize * sizeof(int));
+	if (a->transitionTable == NULL && tableSize != 0) {
+		fprintf(stderr, "Not enough memory for transition table!\n");
+		fclose(f);
+		return 1;
 	}
+	size_t t;
+	for (t = 0; t < tableSize; t++)
+		a->transitionTable[t] = -1;
 	
 	// Load transition table from file
-	const char * transitionLine;
+	char * transitionLine;
 	while ((transitionLine = GetLine(f)) != NULL) {
-		char from[MAX_LINE_LENGTH], symb[MAX_LINE_LENGTH], to[MAX_LINE_LENGTH];
-		sscanf(transitionLine, "%s %s %s", from, symb, to);
+		char * from = ReadWord(&transitionLine);
+		char * symb = ReadWord(&transitionLine);
+		char * to = ReadWord(&transitionLine);
 		
-		int fromIdx, symbolIdx, toIdx;
-		fromIdx = StateToIdx(a, from);
-		symbolIdx = TransitionToIdx(a, symb[0]);
-		toIdx = StateToIdx(a, to);
+		int fromIdx = -1, symbolIdx = -1, toIdx = -1;
+		if (to != NULL) {
+			fromIdx = StateToIdx(a, from);
+			symbolIdx = TransitionToIdx(a, symb[0]);
+			toIdx = StateToIdx(a, to);
+		}
 		
 		if (fromIdx == -1 || symbolIdx == -1 || toIdx == -1) {
-			fprintf(stderr, "Invalid transition: %s %s %s\n", from, symb, to);
+			fprintf(stderr, "Invalid transition: %s %s %s\n", from ? from : "", symb ? symb : "", to ? to : "");
 			fclose(f);
 			return 1;
 		}
 		
 		// Check if we have already loaded this state
-		if (a->transitionTable[fromIdx][symbolIdx] != -1) {
+		int * entry = &a->transitionTable[(size_t) fromIdx * a->transitionsNum + symbolIdx];
+		if (*entry != -1) {
 			fprintf(stderr, "Duplicate transition (except finishing state): %s %s %s\n", from, symb, to);
 			fclose(f);
 			return 1;
 		}
 			
 		
-		a->transitionTable[fromIdx][symbolIdx] = toIdx;
+		*entry = toIdx;
 	}
 	
 	// TODO: check if all transitions were loaded, but may be not nessesary
@@ -258,133 +903,5011 @@ int LoadAutomaton(Automaton * a, const char path[]) {
 	return 0;
 }
 
-// Debug automaton print
-void PrintAutomaton(Automaton * a) {
-	int i,j;
+// This function releases all resources of loaded automaton
+void FreeAutomaton(Automaton * a) {
+	// All names live in one block
+	free(a->namePool.data);
+	free(a->statesNames);
+	free(a->finishState);
+	free(a->stateHash);
+	free(a->transitionTable);
 	
-	printf("Start state: %s\n", a->statesNames[a->startStateIndex]);
+	a->namePool.data = NULL;
+	a->statesNames = NULL;
+	a->finishState = NULL;
+	a->stateHash = NULL;
+	a->transitionTable = NULL;
+	a->statesNum = 0;
+}
+
+// This function prepares nondeterministic automaton without states, symbols and transitions
+void InitNfa(Nfa * n) {
+	int b;
 	
-	printf("End states:  ");
-	for (i = 0; i < a->statesNum; i++)
+	InitAutomaton(&n->states);
+	for (b = 0; b < 256; b++)
+		n->byteSymbol[b] = -1;
+	n->edgeFrom = NULL;
+	n->edgeSymbol = NULL;
+	n->edgeTo = NULL;
+	n->edgesNum = 0;
+	n->edgesCapacity = 0;
+	n->firstEdge = NULL;
+}
+
+// This function releases all resources of nondeterministic automaton
+void FreeNfa(Nfa * n) {
+	FreeAutomaton(&n->states);
+	free(n->edgeFrom);
+	free(n->edgeSymbol);
+	free(n->edgeTo);
+	free(n->firstEdge);
+	InitNfa(n);
+}
+
+// This function appends a transition to nondeterministic automaton, 'symbol' is index of
+// transition symbol or -1 for epsilon transition
+// Returns 0 on success, 1 on failure
+int AddNfaEdge(Nfa * n, int from, int symbol, int to) {
+	if (n->edgesNum == n->edgesCapacity) {
+		int newCapacity = n->edgesCapacity == 0 ? 64 : n->edgesCapacity * 2;
+		int * newFrom = (int *) realloc(n->edgeFrom, newCapacity * sizeof(int));
+		if (newFrom == NULL)
+			return 1;
+		n->edgeFrom = newFrom;
+		
+		int * newSymbol = (int *) realloc(n->edgeSymbol, newCapacity * sizeof(int));
+		if (newSymbol == NULL)
+			return 1;
+		n->edgeSymbol = newSymbol;
+		
+		int * newTo = (int *) realloc(n->edgeTo, newCapacity * sizeof(int));
+		if (newTo == NULL)
+			return 1;
+		n->edgeTo = newTo;
+		
+		n->edgesCapacity = newCapacity;
+	}
+	
+	n->edgeFrom[n->edgesNum] = from;
+	n->edgeSymbol[n->edgesNum] = symbol;
+	n->edgeTo[n->edgesNum] = to;
+	n->edgesNum++;
+	return 0;
+}
+
+// This function groups transitions of nondeterministic automaton by source state
+// and fills firstEdge, it is called once every transition is added
+// Returns 0 on success, 1 on failure
+int SortNfaEdges(Nfa * n) {
+	int statesNum = n->states.statesNum;
+	int edgesNum = n->edgesNum;
+	int i;
+	
+	int * first = (int *) calloc(statesNum + 1, sizeof(int));
+	int * symbols = (int *) malloc((edgesNum + 1) * sizeof(int));
+	int * targets = (int *) malloc((edgesNum + 1) * sizeof(int));
+	if (first == NULL || symbols == NULL || targets == NULL) {
+		free(first);
+		free(symbols);
+		free(targets);
+		return 1;
+	}
+	
+	// Counting sort keeps transitions of a state in order they were added
+	for (i = 0; i < edgesNum; i++)
+		first[n->edgeFrom[i] + 1]++;
+	for (i = 0; i < statesNum; i++)
+		first[i + 1] += first[i];
+	for (i = 0; i < edgesNum; i++) {
+		int position = first[n->edgeFrom[i]]++;
+		symbols[position] = n->edgeSymbol[i];
+		targets[position] = n->edgeTo[i];
+	}
+	// Filling moved every start to the start of the next group, shift them back
+	for (i = statesNum; i > 0; i--)
+		first[i] = first[i - 1];
+	first[0] = 0;
+	
+	for (i = 0; i < statesNum; i++) {
+		int e;
+		for (e = first[i]; e < first[i + 1]; e++)
+			n->edgeFrom[e] = i;
+	}
+	
+	free(n->edgeSymbol);
+	free(n->edgeTo);
+	free(n->firstEdge);
+	n->edgeSymbol = symbols;
+	n->edgeTo = targets;
+	n->edgesCapacity = edgesNum + 1;
+	n->firstEdge = first;
+	return 0;
+}
+
+// This function loads nondeterministic automaton from file. The file is written the same way
+// as for deterministic automaton, but a state may have several transitions on a symbol, and
+// transitions with symbol "eps" are taken without reading input
+// Returns 0 on success, 1 on failure
+int LoadNfa(Nfa * n, const char path[]) {
+	Automaton * a = &n->states;
+	
+	InitNfa(n);
+	
+	FILE * f;
+	f = fopen(path, "r");
+	
+	if (f == NULL) {
+		fprintf(stderr, "File not found or could not be opened: %s\n", path);
+		return 1;
+	}
+	
+	if (ReadAutomatonHeader(a, f)) {
+		fclose(f);
+		return 1;
+	}
+	
+	int j;
+	for (j = 0; j < a->transitionsNum; j++)
+		n->byteSymbol[(unsigned char) a->transitions[j]] = j;
+	
+	char * transitionLine;
+	while ((transitionLine = GetLine(f)) != NULL) {
+		char * from = ReadWord(&transitionLine);
+		char * symb = ReadWord(&transitionLine);
+		char * to = ReadWord(&transitionLine);
+		
+		int fromIdx = -1, symbolIdx = -1, toIdx = -1;
+		if (to != NULL) {
+			fromIdx = StateToIdx(a, from);
+			symbolIdx = strcmp(symb, "eps") == 0 ? -1 : TransitionToIdx(a, symb[0]);
+			toIdx = StateToIdx(a, to);
+		}
+		
+		if (fromIdx == -1 || (symbolIdx == -1 && strcmp(symb, "eps") != 0) || toIdx == -1) {
+			fprintf(stderr, "Invalid transition: %s %s %s\n", from ? from : "", symb ? symb : "", to ? to : "");
+			fclose(f);
+			return 1;
+		}
+		
+		if (AddNfaEdge(n, fromIdx, symbolIdx, toIdx)) {
+			fprintf(stderr, "Not enough memory for transitions!\n");
+			fclose(f);
+			return 1;
+		}
+	}
+	
+	fclose(f);
+	
+	if (SortNfaEdges(n)) {
+		fprintf(stderr, "Not enough memory for transitions!\n");
+		return 1;
+	}
+	return 0;
+}
+
+// This function compares states for qsort
+int CompareStates(const void * x, const void * y) {
+	uint32_t a = *(const uint32_t *) x;
+	uint32_t b = *(const uint32_t *) y;
+	
+	return a < b ? -1 : a > b;
+}
+
+// This function adds every state reachable by epsilon transitions to a set of states of
+// nondeterministic automaton and sorts the set. States of the set are marked in 'marks',
+// marks are cleared when the set is ready. 'set' has room for every state
+// Returns number of states in the set
+int NfaClosure(const Nfa * n, uint8_t * marks, uint32_t * set, int setLength) {
+	int i, e;
+	
+	// States added to the set are scanned in turn
+	for (i = 0; i < setLength; i++)
+		for (e = n->firstEdge[set[i]]; e < n->firstEdge[set[i] + 1]; e++)
+			if (n->edgeSymbol[e] == -1 && !marks[n->edgeTo[e]]) {
+				marks[n->edgeTo[e]] = 1;
+				set[setLength++] = n->edgeTo[e];
+			}
+	
+	qsort(set, setLength, sizeof(uint32_t), CompareStates);
+	for (i = 0; i < setLength; i++)
+		marks[set[i]] = 0;
+	return setLength;
+}
+
+// This function finds set of states of nondeterministic automaton 'engine' that states of
+// 'key' go to on symbol with index byteClass - 1. Class 0 holds bytes that are not symbols,
+// they lead to the empty set. 'scratch' has a mark for every state, all of them cleared
+// Returns number of states in 'nextKey'
+int NfaNextKey(const void * engine, void * scratch, const uint32_t * key, int keyLength, int byteClass, uint32_t * nextKey) {
+	const Nfa * n = (const Nfa *) engine;
+	uint8_t * marks = (uint8_t *) scratch;
+	int symbol = byteClass - 1;
+	int nextLength = 0;
+	int i, e;
+	
+	if (byteClass == 0)
+		return 0;
+	
+	for (i = 0; i < keyLength; i++)
+		for (e = n->firstEdge[key[i]]; e < n->firstEdge[key[i] + 1]; e++)
+			if (n->edgeSymbol[e] == symbol && !marks[n->edgeTo[e]]) {
+				marks[n->edgeTo[e]] = 1;
+				nextKey[nextLength++] = n->edgeTo[e];
+			}
+	
+	return NfaClosure(n, marks, nextKey, nextLength);
+}
+
+// Lazy engine of nondeterministic automaton: set of states accepts if it has a finishing state
+void NfaAccepting(const void * engine, const uint32_t * key, int keyLength, uint64_t * accepted) {
+	const Nfa * n = (const Nfa *) engine;
+	int i;
+	
+	for (i = 0; i < keyLength; i++)
+		if (n->states.finishState[key[i]])
+			accepted[0] |= 1;
+}
+
+// This function finds start set of states of nondeterministic automaton, 'key' has room
+// for every state and 'marks' has a cleared mark for every state
+// Returns number of states in the set
+int NfaStartKey(const Nfa * n, uint8_t * marks, uint32_t * key) {
+	key[0] = n->states.startStateIndex;
+	marks[key[0]] = 1;
+	return NfaClosure(n, marks, key, 1);
+}
+
+// This function appends name of a set of states of nondeterministic automaton to 'name',
+// e.g. "{q0,q2}". Only the first SUBSET_NAME_STATES states are listed
+// Returns 0 on success, 1 on failure
+int AppendSubsetName(const Automaton * a, const uint32_t * key, int keyLength, ByteBuffer * name) {
+	int res = BufferAppend(name, "{", 1);
+	int i;
+	
+	for (i = 0; i < keyLength && i < SUBSET_NAME_STATES; i++) {
+		const char * stateName = StateName(a, key[i]);
+		if (i > 0)
+			res |= BufferAppend(name, ",", 1);
+		res |= BufferAppend(name, stateName, strlen(stateName));
+	}
+	if (keyLength > SUBSET_NAME_STATES)
+		res |= BufferAppend(name, ",...", 4);
+	
+	return res | BufferAppend(name, "}", 2);
+}
+
+// Sets of states found by subset construction, packed one after another
+typedef struct {
+	// States of every set and end offset of every set in 'keys'
+	ByteBuffer keys;
+	ByteBuffer keyEnds;
+	
+	// Open addressing index of sets, empty slots hold -1
+	int * hash;
+	int hashSize;
+} SubsetIndex;
+
+// This function returns slot of subset index that holds set 'key' or empty slot where
+// it should be inserted
+size_t SubsetSlot(const SubsetIndex * index, const uint32_t * key, int keyLength) {
+	const size_t * ends = (const size_t *) index->keyEnds.data;
+	size_t keySize = keyLength * sizeof(uint32_t);
+	size_t mask = index->hashSize - 1;
+	size_t slot = (size_t) HashKey(key, keyLength) & mask;
+	
+	while (index->hash[slot] != -1) {
+		int set = index->hash[slot];
+		size_t start = set == 0 ? 0 : ends[set - 1];
+		if (ends[set] - start == keySize && memcmp(index->keys.data + start, key, keySize) == 0)
+			break;
+		slot = (slot + 1) & mask;
+	}
+	
+	return slot;
+}
+
+// This function finds state of deterministic automaton 'd' made for set of states of
+// nondeterministic automaton 'n', the state is added if the set is new
+// Returns index of the state, -1 if there are too many states or memory ran out
+int SubsetState(const Nfa * n, Automaton * d, SubsetIndex * index, const uint32_t * key, int keyLength) {
+	size_t keySize = keyLength * sizeof(uint32_t);
+	int i;
+	
+	if (index->hashSize != 0) {
+		size_t slot = SubsetSlot(index, key, keyLength);
+		if (index->hash[slot] != -1)
+			return index->hash[slot];
+	}
+	
+	if (d->statesNum == SUBSET_MAX_STATES)
+		return -1;
+	
+	// Index is kept at most half full
+	if (2 * (d->statesNum + 1) > index->hashSize) {
+		int newSize = index->hashSize == 0 ? 64 : index->hashSize * 2;
+		int * newHash = (int *) malloc(newSize * sizeof(int));
+		if (newHash == NULL)
+			return -1;
+		
+		free(index->hash);
+		index->hash = newHash;
+		index->hashSize = newSize;
+		for (i = 0; i < newSize; i++)
+			index->hash[i] = -1;
+		
+		const size_t * ends = (const size_t *) index->keyEnds.data;
+		for (i = 0; i < d->statesNum; i++) {
+			size_t start = i == 0 ? 0 : ends[i - 1];
+			const uint32_t * setKey = (const uint32_t *) (index->keys.data + start);
+			index->hash[SubsetSlot(index, setKey, (int) ((ends[i] - start) / sizeof(uint32_t)))] = i;
+		}
+	}
+	
+	size_t end = index->keys.length + keySize;
+	if (BufferAppend(&index->keys, (const char *) key, keySize)
+		|| BufferAppend(&index->keyEnds, (const char *) &end, sizeof(end)))
+		return -1;
+	
+	// Names of long sets are cut, such names are told apart by index of the state
+	ByteBuffer name = { NULL, 0, 0 };
+	if (AppendSubsetName(&n->states, key, keyLength, &name)) {
+		free(name.data);
+		return -1;
+	}
+	if (StateToIdx(d, name.data) != -1) {
+		char suffix[32];
+		sprintf(suffix, "#%d", d->statesNum);
+		name.length--;
+		if (BufferAppend(&name, suffix, strlen(suffix) + 1)) {
+			free(name.data);
+			return -1;
+		}
+	}
+	
+	int res = AddState(d, name.data) || IndexState(d);
+	free(name.data);
+	if (res)
+		return -1;
+	
+	for (i = 0; i < keyLength; i++)
+		if (n->states.finishState[key[i]])
+			d->finishState[d->statesNum - 1] = 1;
+	
+	index->hash[SubsetSlot(index, key, keyLength)] = d->statesNum - 1;
+	return d->statesNum - 1;
+}
+
+// This function makes deterministic automaton 'd' of nondeterministic automaton 'n' with
+// subset construction. Only sets reachable from the start set become states, and transitions
+// to the empty set are missing
+// Returns 0 on success, 1 on failure
+int DeterminizeNfa(const Nfa * n, Automaton * d) {
+	const Automaton * a = &n->states;
+	int k = a->transitionsNum;
+	SubsetIndex index = { { NULL, 0, 0 }, { NULL, 0, 0 }, NULL, 0 };
+	ByteBuffer table = { NULL, 0, 0 };
+	int res = 1;
+	int i, j;
+	
+	InitAutomaton(d);
+	d->transitionsNum = k;
+	memcpy(d->transitions, a->transitions, k);
+	
+	uint8_t * marks = (uint8_t *) calloc(a->statesNum, sizeof(uint8_t));
+	uint32_t * key = (uint32_t *) malloc(a->statesNum * sizeof(uint32_t));
+	uint32_t * nextKey = (uint32_t *) malloc(a->statesNum * sizeof(uint32_t));
+	if (marks == NULL || key == NULL || nextKey == NULL) {
+		fprintf(stderr, "Not enough memory for subset construction!\n");
+		goto done;
+	}
+	
+	d->startStateIndex = SubsetState(n, d, &index, key, NfaStartKey(n, marks, key));
+	if (d->startStateIndex == -1) {
+		fprintf(stderr, "Not enough memory for subset construction!\n");
+		goto done;
+	}
+	
+	// States are explored in order they are found
+	for (i = 0; i < d->statesNum; i++) {
+		const size_t * ends = (const size_t *) index.keyEnds.data;
+		size_t start = i == 0 ? 0 : ends[i - 1];
+		int keyLength = (int) ((ends[i] - start) / sizeof(uint32_t));
+		
+		// Index may move while the row is filled
+		memcpy(key, index.keys.data + start, keyLength * sizeof(uint32_t));
+		
+		for (j = 0; j < k; j++) {
+			int nextLength = NfaNextKey(n, marks, key, keyLength, j + 1, nextKey);
+			int to = nextLength == 0 ? -1 : SubsetState(n, d, &index, nextKey, nextLength);
+			
+			if (nextLength != 0 && to == -1) {
+				if (d->statesNum == SUBSET_MAX_STATES)
+					fprintf(stderr, "Deterministic automaton has more than %d states, use -l to build it lazily!\n", SUBSET_MAX_STATES);
+				else
+					fprintf(stderr, "Not enough memory for subset construction!\n");
+				goto done;
+			}
+			
+			if (BufferAppend(&table, (const char *) &to, sizeof(to))) {
+				fprintf(stderr, "Not enough memory for transition table!\n");
+				goto done;
+			}
+		}
+	}
+	
+	d->transitionTable = (int *) table.data;
+	table.data = NULL;
+	res = 0;
+	
+done:
+	if (res)
+		FreeAutomaton(d);
+	free(index.keys.data);
+	free(index.keyEnds.data);
+	free(index.hash);
+	free(table.data);
+	free(marks);
+	free(key);
+	free(nextKey);
+	return res;
+}
+
+// Kinds of nodes of parsed regular expression
+#define REGEX_SET 0
+#define REGEX_SEQUENCE 1
+#define REGEX_ALTERNATION 2
+#define REGEX_REPEAT 3
+
+// Node of parsed regular expression. Sequences and alternations keep their parts in a list
+// of siblings, so long expressions do not nest
+typedef struct {
+	int type;
+	
+	// First part of sequence, alternation or repetition and the next part of the parent
+	int child;
+	int next;
+	
+	// Bounds of repetition, max is -1 when it is unbounded
+	int min;
+	int max;
+	
+	// Bytes that REGEX_SET matches, byte b is bit b % 8 of bytes[b / 8]
+	uint8_t bytes[32];
+} RegexNode;
+
+// State of parser of regular expression
+typedef struct {
+	const char * pattern;
+	const char * cursor;
+	
+	RegexNode * nodes;
+	int nodesNum;
+	int nodesCapacity;
+	
+	// Number of groups the cursor is in
+	int depth;
+	
+	// Set when input is a stream where line ends are bytes like the others, otherwise
+	// byte sets never hold them
+	int scan;
+	
+	// Description of the first error, NULL if there is none
+	const char * error;
+} RegexParser;
+
+// This function appends a node to parsed regular expression
+// Returns index of the node, -1 if memory ran out
+int AddRegexNode(RegexParser * p, int type) {
+	if (p->nodesNum == p->nodesCapacity) {
+		int newCapacity = p->nodesCapacity == 0 ? 64 : p->nodesCapacity * 2;
+		RegexNode * newNodes = (RegexNode *) realloc(p->nodes, newCapacity * sizeof(RegexNode));
+		if (newNodes == NULL) {
+			p->error = "Not enough memory";
+			return -1;
+		}
+		p->nodes = newNodes;
+		p->nodesCapacity = newCapacity;
+	}
+	
+	RegexNode * node = &p->nodes[p->nodesNum];
+	memset(node, 0, sizeof(RegexNode));
+	node->type = type;
+	node->child = -1;
+	node->next = -1;
+	return p->nodesNum++;
+}
+
+// This function adds bytes from 'first' to 'last' to a byte set
+void AddByteRange(uint8_t * bytes, int first, int last) {
+	int b;
+	
+	for (b = first; b <= last; b++)
+		bytes[b / 8] |= (uint8_t) (1 << (b % 8));
+}
+
+// This function tells the only byte of a byte set
+// Returns the byte, -1 if the set has other number of bytes
+int SingleByte(const uint8_t * bytes) {
+	int single = -1;
+	int b;
+	
+	for (b = 0; b < 256; b++)
+		if (bytes[b / 8] & (1 << (b % 8))) {
+			if (single != -1)
+				return -1;
+			single = b;
+		}
+	
+	return single;
+}
+
+// This function adds bytes of escape sequence of regular expression to a byte set, the cursor is
+// right after backslash. \d, \w and \s are digits, word bytes and spaces, capital letters
+// stand for the other bytes, \t, \n, \r, \f, \v and \xHH are single bytes, other letters and
+// digits are not supported and other bytes stand for themselves
+// Returns 0 on success, 1 if escape sequence is invalid
+int ParseRegexEscape(RegexParser * p, uint8_t * bytes) {
+	uint8_t escaped[32];
+	int c = (unsigned char) *p->cursor;
+	int i;
+	
+	if (c == '\0') {
+		p->error = "Nothing to escape";
+		return 1;
+	}
+	p->cursor++;
+	
+	memset(escaped, 0, sizeof(escaped));
+	switch (tolower(c)) {
+		case 'd':
+		AddByteRange(escaped, '0', '9');
+		break;
+		
+		case 'w':
+		AddByteRange(escaped, '0', '9');
+		AddByteRange(escaped, 'A', 'Z');
+		AddByteRange(escaped, 'a', 'z');
+		AddByteRange(escaped, '_', '_');
+		break;
+		
+		case 's':
+		AddByteRange(escaped, '\t', '\r');
+		AddByteRange(escaped, ' ', ' ');
+		break;
+		
+		default:
+		if (c == 'x' && isxdigit((unsigned char) p->cursor[0]) && isxdigit((unsigned char) p->cursor[1])) {
+			char hex[3] = { p->cursor[0], p->cursor[1], '\0' };
+			c = (int) strtol(hex, NULL, 16);
+			p->cursor += 2;
+		} else if (c == 't') {
+			c = '\t';
+		} else if (c == 'n') {
+			c = '\n';
+		} else if (c == 'r') {
+			c = '\r';
+		} else if (c == 'f') {
+			c = '\f';
+		} else if (c == 'v') {
+			c = '\v';
+		} else if (isalnum(c)) {
+			p->cursor -= 2;
+			p->error = "Unknown escape sequence";
+			return 1;
+		}
+		AddByteRange(bytes, c, c);
+		return 0;
+	}
+	
+	// Capital letter takes the complement
+	for (i = 0; i < 32; i++)
+		bytes[i] |= isupper(c) ? (uint8_t) ~escaped[i] : escaped[i];
+	return 0;
+}
+
+// This function parses bracket expression of regular expression, e.g. [a-z_] or [^0-9],
+// the cursor is right after the opening bracket
+// Returns 0 on success, 1 on failure
+int ParseRegexClass(RegexParser * p, uint8_t * bytes) {
+	uint8_t members[32];
+	int negated = 0;
+	int i;
+	
+	memset(members, 0, sizeof(members));
+	if (*p->cursor == '^') {
+		negated = 1;
+		p->cursor++;
+	}
+	
+	// Closing bracket right at the start is a member
+	int first = 1;
+	while (*p->cursor != ']' || first) {
+		if (*p->cursor == '\0') {
+			p->error = "Missing ]";
+			return 1;
+		}
+		
+		int c = (unsigned char) *p->cursor++;
+		first = 0;
+		
+		if (c == '\\') {
+			uint8_t escaped[32];
+			memset(escaped, 0, sizeof(escaped));
+			if (ParseRegexEscape(p, escaped))
+				return 1;
+			
+			// Only a single escaped byte may start a range
+			for (i = 0; i < 32; i++)
+				members[i] |= escaped[i];
+			c = SingleByte(escaped);
+			if (c == -1)
+				continue;
+		}
+		
+		if (p->cursor[0] == '-' && p->cursor[1] != ']' && p->cursor[1] != '\0') {
+			int last = (unsigned char) p->cursor[1];
+			p->cursor += 2;
+			if (last == '\\') {
+				uint8_t escaped[32];
+				memset(escaped, 0, sizeof(escaped));
+				if (ParseRegexEscape(p, escaped))
+					return 1;
+				last = SingleByte(escaped);
+			}
+			if (last < c) {
+				p->error = "Invalid range";
+				return 1;
+			}
+			AddByteRange(members, c, last);
+		} else {
+			AddByteRange(members, c, c);
+		}
+	}
+	p->cursor++;
+	
+	for (i = 0; i < 32; i++)
+		bytes[i] |= negated ? (uint8_t) ~members[i] : members[i];
+	return 0;
+}
+
+// This function reads a number of repetition bounds
+// Returns the number, -1 if there is no number
+int ParseRegexNumber(RegexParser * p) {
+	int value = -1;
+	
+	while (isdigit((unsigned char) *p->cursor)) {
+		value = (value == -1 ? 0 : value * 10) + (*p->cursor++ - '0');
+		if (value > REGEX_MAX_REPEAT)
+			value = REGEX_MAX_REPEAT + 1;
+	}
+	
+	return value;
+}
+
+int ParseRegexAlternation(RegexParser * p);
+
+// This function parses atom of regular expression with repetitions that follow it
+// Returns index of its node, -1 on failure
+int ParseRegexPiece(RegexParser * p) {
+	int c = (unsigned char) *p->cursor++;
+	int node;
+	
+	if (c == '(') {
+		if (++p->depth > REGEX_MAX_DEPTH) {
+			p->error = "Too many nested groups";
+			return -1;
+		}
+		node = ParseRegexAlternation(p);
+		if (node == -1)
+			return -1;
+		if (*p->cursor != ')') {
+			p->error = "Missing )";
+			return -1;
+		}
+		p->cursor++;
+		p->depth--;
+	} else if (c == '*' || c == '+' || c == '?' || c == '{') {
+		p->error = "Nothing to repeat";
+		return -1;
+	} else if (c == '^' || c == '$') {
+		p->error = "Anchors are only supported at the ends of alternatives of the whole expression";
+		return -1;
+	} else {
+		node = AddRegexNode(p, REGEX_SET);
+		if (node == -1)
+			return -1;
+		
+		uint8_t * bytes = p->nodes[node].bytes;
+		if (c == '.')
+			AddByteRange(bytes, 0, 255);
+		else if (c == '[' && ParseRegexClass(p, bytes))
+			return -1;
+		else if (c == '\\' && ParseRegexEscape(p, bytes))
+			return -1;
+		else if (c != '[' && c != '\\')
+			AddByteRange(bytes, c, c);
+		
+		// Records never hold line ends
+		if (!p->scan)
+			bytes['\n' / 8] &= (uint8_t) ~(1 << ('\n' % 8));
+	}
+	
+	for (;;) {
+		int min, max;
+		c = *p->cursor;
+		
+		if (c == '*') {
+			min = 0;
+			max = -1;
+		} else if (c == '+') {
+			min = 1;
+			max = -1;
+		} else if (c == '?') {
+			min = 0;
+			max = 1;
+		} else if (c == '{') {
+			p->cursor++;
+			min = ParseRegexNumber(p);
+			max = min;
+			if (*p->cursor == ',') {
+				p->cursor++;
+				max = ParseRegexNumber(p);
+			}
+			if (min == -1 || *p->cursor != '}' || (max != -1 && max < min)) {
+				p->error = "Invalid repetition bounds";
+				return -1;
+			}
+			if (min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT) {
+				p->error = "Too many repetitions";
+				return -1;
+			}
+		} else {
+			return node;
+		}
+		p->cursor++;
+		
+		int repeat = AddRegexNode(p, REGEX_REPEAT);
+		if (repeat == -1)
+			return -1;
+		p->nodes[repeat].child = node;
+		p->nodes[repeat].min = min;
+		p->nodes[repeat].max = max;
+		node = repeat;
+	}
+}
+
+// This function parses pieces of regular expression up to '|', ')' or '$' that ends the expression
+// Returns index of sequence node, -1 on failure
+int ParseRegexSequence(RegexParser * p) {
+	int sequence = AddRegexNode(p, REGEX_SEQUENCE);
+	int last = -1;
+	
+	if (sequence == -1)
+		return -1;
+	
+	while (*p->cursor != '\0' && *p->cursor != '|' && *p->cursor != ')'
+		&& !(p->depth == 0 && p->cursor[0] == '$' && (p->cursor[1] == '\0' || p->cursor[1] == '|'))) {
+		int piece = ParseRegexPiece(p);
+		if (piece == -1)
+			return -1;
+		
+		if (last == -1)
+			p->nodes[sequence].child = piece;
+		else
+			p->nodes[last].next = piece;
+		last = piece;
+	}
+	
+	return sequence;
+}
+
+// This function parses alternatives of regular expression inside a group
+// Returns index of alternation node, -1 on failure
+int ParseRegexAlternation(RegexParser * p) {
+	int alternation = AddRegexNode(p, REGEX_ALTERNATION);
+	int last = -1;
+	
+	if (alternation == -1)
+		return -1;
+	
+	for (;;) {
+		int sequence = ParseRegexSequence(p);
+		if (sequence == -1)
+			return -1;
+		
+		if (last == -1)
+			p->nodes[alternation].child = sequence;
+		else
+			p->nodes[last].next = sequence;
+		last = sequence;
+		
+		if (*p->cursor != '|')
+			return alternation;
+		p->cursor++;
+	}
+}
+
+// This function splits bytes that are symbols of regular expression, every byte but line end
+// unless input is scanned as a stream, into classes: bytes of a class are in the same sets
+// of every node
+// Returns number of classes
+int BuildRegexClasses(const RegexParser * p, int * byteClass) {
+	int classesNum = 1;
+	int split[512];
+	int b, i;
+	
+	for (b = 0; b < 256; b++)
+		byteClass[b] = b == '\n' && !p->scan ? -1 : 0;
+	
+	for (i = 0; i < p->nodesNum; i++) {
+		const uint8_t * bytes = p->nodes[i].bytes;
+		int newClassesNum = 0;
+		
+		if (p->nodes[i].type != REGEX_SET)
+			continue;
+		
+		// Class is split into bytes in the set and the other bytes
+		for (b = 0; b < 2 * classesNum; b++)
+			split[b] = -1;
+		for (b = 0; b < 256; b++) {
+			if (byteClass[b] == -1)
+				continue;
+			int part = byteClass[b] * 2 + ((bytes[b / 8] >> (b % 8)) & 1);
+			if (split[part] == -1)
+				split[part] = newClassesNum++;
+			byteClass[b] = split[part];
+		}
+		classesNum = newClassesNum;
+	}
+	
+	return classesNum;
+}
+
+// State of building nondeterministic automaton of parsed regular expression
+typedef struct {
+	const RegexParser * parser;
+	Nfa * nfa;
+	
+	// Some byte of every class
+	int classByte[256];
+	int classesNum;
+	
+	// Set when automaton could not be built, and also 'tooLarge' when it has outgrown REGEX_MAX_SIZE
+	int failed;
+	int tooLarge;
+} RegexBuilder;
+
+// This function adds a state to automaton of regular expression
+// Returns index of the state
+int AddRegexState(RegexBuilder * r) {
+	char name[32];
+	
+	if (r->nfa->states.statesNum >= REGEX_MAX_SIZE) {
+		r->failed = 1;
+		r->tooLarge = 1;
+	} else {
+		sprintf(name, "r%d", r->nfa->states.statesNum);
+		if (AddState(&r->nfa->states, name))
+			r->failed = 1;
+	}
+	return r->nfa->states.statesNum - 1;
+}
+
+// This function adds a transition to automaton of regular expression
+void AddRegexEdge(RegexBuilder * r, int from, int symbol, int to) {
+	if (r->failed)
+		return;
+	
+	if (r->nfa->edgesNum >= REGEX_MAX_SIZE) {
+		r->failed = 1;
+		r->tooLarge = 1;
+	} else if (AddNfaEdge(r->nfa, from, symbol, to)) {
+		r->failed = 1;
+	}
+}
+
+// This function adds states and transitions that match node of regular expression from
+// state 'from' with Thompson's construction
+// Returns state the node ends in
+int BuildRegexNode(RegexBuilder * r, int node, int from) {
+	const RegexNode * n = &r->parser->nodes[node];
+	int to, part, i, k;
+	
+	switch (n->type) {
+		case REGEX_SET:
+		to = AddRegexState(r);
+		for (k = 0; k < r->classesNum; k++)
+			if (n->bytes[r->classByte[k] / 8] & (1 << (r->classByte[k] % 8)))
+				AddRegexEdge(r, from, k, to);
+		return to;
+		
+		case REGEX_SEQUENCE:
+		for (part = n->child; part != -1 && !r->failed; part = r->parser->nodes[part].next)
+			from = BuildRegexNode(r, part, from);
+		return from;
+		
+		case REGEX_ALTERNATION:
+		to = AddRegexState(r);
+		for (part = n->child; part != -1 && !r->failed; part = r->parser->nodes[part].next) {
+			int start = AddRegexState(r);
+			AddRegexEdge(r, from, -1, start);
+			AddRegexEdge(r, BuildRegexNode(r, part, start), -1, to);
+		}
+		return to;
+		
+		default:
+		for (i = 0; i < n->min && !r->failed; i++)
+			from = BuildRegexNode(r, n->child, from);
+		
+		to = AddRegexState(r);
+		if (n->max == -1) {
+			// Loop state is left to the next repetition or out
+			int loop = AddRegexState(r);
+			AddRegexEdge(r, from, -1, loop);
+			AddRegexEdge(r, BuildRegexNode(r, n->child, loop), -1, loop);
+			AddRegexEdge(r, loop, -1, to);
+		} else {
+			// Every optional repetition may be the last one
+			for (i = n->min; i < n->max && !r->failed; i++) {
+				AddRegexEdge(r, from, -1, to);
+				from = BuildRegexNode(r, n->child, from);
+			}
+			AddRegexEdge(r, from, -1, to);
+		}
+		return to;
+	}
+}
+
+// This function compiles regular expression into nondeterministic automaton with Thompson's
+// construction. Every byte but line end is a symbol, bytes that the expression does not tell
+// apart share a symbol. Alternatives of the whole expression match anywhere in a record
+// unless they start with '^' or end with '$'. With 'scan' set line end is a symbol too and
+// the automaton matches exactly the expression, which has no anchors then
+// Returns 0 on success, 1 on failure
+int RegexToNfa(const char * regex, Nfa * n, int scan) {
+	RegexParser p;
+	RegexBuilder r;
+	int byteClass[256];
+	int b, k;
+	
+	memset(&p, 0, sizeof(p));
+	p.pattern = regex;
+	p.cursor = regex;
+	p.scan = scan;
+	InitNfa(n);
+	
+	// Whole expression is an alternation that knows anchors
+	int top = AddRegexNode(&p, REGEX_ALTERNATION);
+	int last = -1;
+	while (top != -1) {
+		int anchoredStart = *p.cursor == '^';
+		if (anchoredStart && scan) {
+			p.error = "Anchors are not supported in scan mode";
+			break;
+		}
+		if (anchoredStart)
+			p.cursor++;
+		
+		int sequence = ParseRegexSequence(&p);
+		if (sequence == -1)
+			break;
+		
+		int anchoredEnd = *p.cursor == '$';
+		if (anchoredEnd && scan) {
+			p.error = "Anchors are not supported in scan mode";
+			break;
+		}
+		if (anchoredEnd)
+			p.cursor++;
+		
+		// Anchors are kept in bounds of the sequence node
+		p.nodes[sequence].min = anchoredStart || scan;
+		p.nodes[sequence].max = anchoredEnd || scan;
+		if (last == -1)
+			p.nodes[top].child = sequence;
+		else
+			p.nodes[last].next = sequence;
+		last = sequence;
+		
+		if (*p.cursor == ')') {
+			p.error = "Unmatched )";
+			break;
+		}
+		if (*p.cursor == '\0')
+			break;
+		p.cursor++;
+	}
+	
+	if (p.error != NULL || top == -1) {
+		fprintf(stderr, "%s at position %d of regular expression!\n",
+			p.error != NULL ? p.error : "Not enough memory", (int) (p.cursor - regex));
+		free(p.nodes);
+		return 1;
+	}
+	
+	memset(&r, 0, sizeof(r));
+	r.parser = &p;
+	r.nfa = n;
+	r.classesNum = BuildRegexClasses(&p, byteClass);
+	for (b = 255; b >= 0; b--)
+		if (byteClass[b] != -1) {
+			r.classByte[byteClass[b]] = b;
+			n->byteSymbol[b] = byteClass[b];
+		}
+	
+	// Symbols are named after some byte of their class
+	n->states.transitionsNum = r.classesNum;
+	for (k = 0; k < r.classesNum; k++)
+		n->states.transitions[k] = (char) r.classByte[k];
+	
+	// States that skip input before and after unanchored alternatives exist only when needed
+	int start = AddRegexState(&r);
+	int finish = AddRegexState(&r);
+	int skipBefore = -1, skipAfter = -1;
+	n->states.startStateIndex = start;
+	
+	int sequence;
+	for (sequence = p.nodes[top].child; sequence != -1 && !r.failed; sequence = p.nodes[sequence].next) {
+		int from = start;
+		if (!p.nodes[sequence].min) {
+			if (skipBefore == -1) {
+				skipBefore = AddRegexState(&r);
+				AddRegexEdge(&r, start, -1, skipBefore);
+				for (k = 0; k < r.classesNum; k++)
+					AddRegexEdge(&r, skipBefore, k, skipBefore);
+			}
+			from = skipBefore;
+		}
+		
+		// Sequence node is built as it is, its bounds only tell anchors
+		int first = AddRegexState(&r);
+		AddRegexEdge(&r, from, -1, first);
+		int end = BuildRegexNode(&r, sequence, first);
+		
+		if (!p.nodes[sequence].max) {
+			if (skipAfter == -1) {
+				skipAfter = AddRegexState(&r);
+				AddRegexEdge(&r, skipAfter, -1, finish);
+				for (k = 0; k < r.classesNum; k++)
+					AddRegexEdge(&r, skipAfter, k, skipAfter);
+			}
+			AddRegexEdge(&r, end, -1, skipAfter);
+		} else {
+			AddRegexEdge(&r, end, -1, finish);
+		}
+	}
+	
+	free(p.nodes);
+	if (r.tooLarge) {
+		fprintf(stderr, "Expression is too large, its automaton has more than %d states or transitions!\n",
+			REGEX_MAX_SIZE);
+		return 1;
+	}
+	if (r.failed || SortNfaEdges(n)) {
+		fprintf(stderr, "Not enough memory for automaton of regular expression!\n");
+		return 1;
+	}
+	n->states.finishState[finish] = 1;
+	return 0;
+}
+
+// This function makes automaton 'e' that reads bytes of automaton 'a' whose symbols stand for
+// classes of bytes, 'byteSymbol' tells symbol of every byte or -1 for bytes that are not symbols
+// Returns 0 on success, 1 on failure
+int ExpandSymbols(const Automaton * a, const int * byteSymbol, Automaton * e) {
+	int q, b, j;
+	
+	InitAutomaton(e);
+	for (b = 0; b < 256; b++)
+		if (byteSymbol[b] != -1)
+			e->transitions[e->transitionsNum++] = (char) b;
+	
+	for (q = 0; q < a->statesNum; q++) {
+		if (AddState(e, StateName(a, q)) || IndexState(e)) {
+			fprintf(stderr, "Cannot store state %s!\n", StateName(a, q));
+			FreeAutomaton(e);
+			return 1;
+		}
+		e->finishState[q] = a->finishState[q];
+	}
+	e->startStateIndex = a->startStateIndex;
+	
+	e->transitionTable = (int *) malloc(((size_t) e->statesNum * e->transitionsNum + 1) * sizeof(int));
+	if (e->transitionTable == NULL) {
+		fprintf(stderr, "Not enough memory for transition table!\n");
+		FreeAutomaton(e);
+		return 1;
+	}
+	for (q = 0; q < e->statesNum; q++)
+		for (j = 0; j < e->transitionsNum; j++) {
+			int symbol = byteSymbol[(unsigned char) e->transitions[j]];
+			e->transitionTable[(size_t) q * e->transitionsNum + j] = a->transitionTable[(size_t) q * a->transitionsNum + symbol];
+		}
+	
+	return 0;
+}
+
+// This function makes nondeterministic automaton find its matches anywhere in input: a new
+// start state reads any byte and stays, or goes on to the old start state. Bytes that are not
+// symbols get a symbol of their own that only the new start state reads, so they end matches
+// but not the search
+// Returns 0 on success, 1 on failure
+int AddScanPrefix(Nfa * n) {
+	Automaton * a = &n->states;
+	int other = -1;
+	int b, j;
+	
+	for (b = 0; b < 256; b++)
+		if (n->byteSymbol[b] == -1) {
+			if (other == -1) {
+				other = a->transitionsNum++;
+				a->transitions[other] = (char) b;
+			}
+			n->byteSymbol[b] = other;
+		}
+	
+	if (AddState(a, "*"))
+		return 1;
+	
+	int prefix = a->statesNum - 1;
+	for (j = 0; j < a->transitionsNum; j++)
+		if (AddNfaEdge(n, prefix, j, prefix))
+			return 1;
+	if (AddNfaEdge(n, prefix, -1, a->startStateIndex))
+		return 1;
+	
+	a->startStateIndex = prefix;
+	return SortNfaEdges(n);
+}
+
+// This function removes states that cannot be reached from the start state and dead states,
+// from which no finishing state can be reached. Transitions to removed states become missing,
+// so all dead states collapse into the single dead state of compiled automaton.
+// The start state is always kept. 'stateMap' receives new index of every original state,
+// -1 for removed ones
+// Returns 0 on success, 1 on failure
+int PruneAutomaton(const Automaton * a, Automaton * p, int * stateMap) {
+	int n = a->statesNum;
+	int k = a->transitionsNum;
+	int i, j, q;
+	
+	char * reachable = (char *) calloc(n, sizeof(char));
+	char * alive = (char *) calloc(n, sizeof(char));
+	int * queue = (int *) malloc(n * sizeof(int));
+	int * predStart = (int *) calloc(n + 1, sizeof(int));
+	int * preds = (int *) malloc(((size_t) n * k + 1) * sizeof(int));
+	
+	int res = 1;
+	if (reachable == NULL || alive == NULL || queue == NULL || predStart == NULL || preds == NULL) {
+		fprintf(stderr, "Not enough memory for pruning!\n");
+		goto done;
+	}
+	
+	// Forward search from start state
+	int queueNum = 0;
+	queue[queueNum++] = a->startStateIndex;
+	reachable[a->startStateIndex] = 1;
+	for (i = 0; i < queueNum; i++)
+		for (j = 0; j < k; j++) {
+			int to = a->transitionTable[(size_t) queue[i] * k + j];
+			if (to != -1 && !reachable[to]) {
+				reachable[to] = 1;
+				queue[queueNum++] = to;
+			}
+		}
+	
+	// Lists of predecessors of every state
+	for (q = 0; q < n; q++)
+		for (j = 0; j < k; j++) {
+			int to = a->transitionTable[(size_t) q * k + j];
+			if (to != -1)
+				predStart[to + 1]++;
+		}
+	for (q = 0; q < n; q++)
+		predStart[q + 1] += predStart[q];
+	for (q = 0; q < n; q++)
+		for (j = 0; j < k; j++) {
+			int to = a->transitionTable[(size_t) q * k + j];
+			if (to != -1)
+				preds[predStart[to]++] = q;
+		}
+	// Filling moved every start to the start of the next list, shift them back
+	for (q = n; q > 0; q--)
+		predStart[q] = predStart[q - 1];
+	predStart[0] = 0;
+	
+	// Backward search from finishing states
+	queueNum = 0;
+	for (q = 0; q < n; q++)
+		if (a->finishState[q]) {
+			alive[q] = 1;
+			queue[queueNum++] = q;
+		}
+	for (i = 0; i < queueNum; i++)
+		for (j = predStart[queue[i]]; j < predStart[queue[i] + 1]; j++)
+			if (!alive[preds[j]]) {
+				alive[preds[j]] = 1;
+				queue[queueNum++] = preds[j];
+			}
+	
+	// Keep useful states in their original order
+	InitAutomaton(p);
+	p->transitionsNum = k;
+	memcpy(p->transitions, a->transitions, k);
+	for (q = 0; q < n; q++) {
+		if (!(reachable[q] && alive[q]) && q != a->startStateIndex) {
+			stateMap[q] = -1;
+			continue;
+		}
+		
+		stateMap[q] = p->statesNum;
+		if (AddState(p, StateName(a, q)) || IndexState(p)) {
+			fprintf(stderr, "Cannot store state %s!\n", StateName(a, q));
+			FreeAutomaton(p);
+			goto done;
+		}
+		p->finishState[p->statesNum - 1] = a->finishState[q];
+	}
+	p->startStateIndex = stateMap[a->startStateIndex];
+	
+	p->transitionTable = (int *) malloc(((size_t) p->statesNum * k + 1) * sizeof(int));
+	if (p->transitionTable == NULL) {
+		fprintf(stderr, "Not enough memory for transition table!\n");
+		FreeAutomaton(p);
+		goto done;
+	}
+	for (q = 0; q < n; q++) {
+		if (stateMap[q] == -1)
+			continue;
+		
+		for (j = 0; j < k; j++) {
+			int to = a->transitionTable[(size_t) q * k + j];
+			// Dead start state is kept, but nothing leads anywhere from it
+			if (to != -1 && !alive[to])
+				to = -1;
+			p->transitionTable[(size_t) stateMap[q] * k + j] = to == -1 ? -1 : stateMap[to];
+		}
+	}
+	
+	res = 0;
+	
+done:
+	free(reachable);
+	free(alive);
+	free(queue);
+	free(predStart);
+	free(preds);
+	return res;
+}
+
+// This function minimizes automaton with Hopcroft's partition refinement algorithm
+// Missing transitions are treated as transitions to an implicit dead state. Result 'm' is
+// the minimal automaton with states numbered in breadth-first order from the start state,
+// each named after the first original state of its class. States equivalent to the dead one
+// are dropped, so transitions to them are missing.
+// Returns 0 on success, 1 on failure
+int MinimizeAutomaton(const Automaton * a, Automaton * m) {
+	int n = a->statesNum + 1;
+	int k = a->transitionsNum;
+	int dead = a->statesNum;
+	int i, j, q;
+	
+	// Complete transition function with dead state
+	int * delta = (int *) malloc(((size_t) n * k + 1) * sizeof(int));
+	// Predecessors of every (state, symbol) in counting sort order
+	int * predStart = (int *) calloc((size_t) n * k + 1, sizeof(int));
+	int * preds = (int *) malloc(((size_t) n * k + 1) * sizeof(int));
+	// Partition: states of every block are kept together in 'elems',
+	// marked states of a block are moved to the beginning of its range
+	int * elems = (int *) malloc(n * sizeof(int));
+	int * loc = (int *) malloc(n * sizeof(int));
+	int * blockOf = (int *) malloc(n * sizeof(int));
+	int * first = (int *) malloc(n * sizeof(int));
+	int * last = (int *) malloc(n * sizeof(int));
+	int * marked = (int *) calloc(n, sizeof(int));
+	int * touched = (int *) malloc(n * sizeof(int));
+	int * splitter = (int *) malloc(n * sizeof(int));
+	// Pending (block, symbol) splitters
+	int * workBlock = (int *) malloc(((size_t) n * k + 1) * sizeof(int));
+	int * workSymbol = (int *) malloc(((size_t) n * k + 1) * sizeof(int));
+	char * inWork = (char *) calloc((size_t) n * k + 1, sizeof(char));
+	int * order = (int *) malloc(n * sizeof(int));
+	int * minIndex = (int *) malloc(n * sizeof(int));
+	int * repr = (int *) malloc(n * sizeof(int));
+	
+	int res = 1;
+	if (delta == NULL || predStart == NULL || preds == NULL || elems == NULL || loc == NULL
+		|| blockOf == NULL || first == NULL || last == NULL || marked == NULL || touched == NULL
+		|| splitter == NULL || workBlock == NULL || workSymbol == NULL || inWork == NULL
+		|| order == NULL || minIndex == NULL || repr == NULL) {
+		fprintf(stderr, "Not enough memory for minimization!\n");
+		goto done;
+	}
+	
+	for (q = 0; q < n; q++)
+		for (j = 0; j < k; j++) {
+			int to = q == dead ? -1 : a->transitionTable[(size_t) q * k + j];
+			delta[(size_t) q * k + j] = to == -1 ? dead : to;
+		}
+	
+	// Build lists of predecessors, indexed by (target, symbol)
+	for (q = 0; q < n; q++)
+		for (j = 0; j < k; j++)
+			predStart[(size_t) delta[(size_t) q * k + j] * k + j + 1]++;
+	for (i = 0; i < n * k; i++)
+		predStart[i + 1] += predStart[i];
+	for (q = 0; q < n; q++)
+		for (j = 0; j < k; j++) {
+			size_t key = (size_t) delta[(size_t) q * k + j] * k + j;
+			preds[predStart[key]++] = q;
+		}
+	// Filling moved every start to the start of the next list, shift them back
+	for (i = n * k; i > 0; i--)
+		predStart[i] = predStart[i - 1];
+	predStart[0] = 0;
+	
+	// Initial partition: finishing states and the rest
+	int blocksNum = 0;
+	int finishCount = 0;
+	for (q = 0; q < n; q++)
+		if (q != dead && a->finishState[q])
+			finishCount++;
+	
+	int pos[2] = { 0, finishCount };
+	for (q = 0; q < n; q++) {
+		int group = (q != dead && a->finishState[q]) ? 0 : 1;
+		elems[pos[group]] = q;
+		loc[q] = pos[group]++;
+	}
+	
+	if (finishCount > 0) {
+		first[blocksNum] = 0;
+		last[blocksNum] = finishCount;
+		blocksNum++;
+	}
+	first[blocksNum] = finishCount;
+	last[blocksNum] = n;
+	blocksNum++;
+	for (i = 0; i < n; i++)
+		blockOf[elems[i]] = i < finishCount ? 0 : blocksNum - 1;
+	
+	// Initially every block is a splitter for every symbol
+	int workNum = 0;
+	for (i = 0; i < blocksNum; i++)
+		for (j = 0; j < k; j++) {
+			workBlock[workNum] = i;
+			workSymbol[workNum] = j;
+			workNum++;
+			inWork[(size_t) i * k + j] = 1;
+		}
+	
+	while (workNum > 0) {
+		workNum--;
+		int b = workBlock[workNum];
+		int symbol = workSymbol[workNum];
+		inWork[(size_t) b * k + symbol] = 0;
+		
+		// Collect states that go into block 'b' on 'symbol' before anything moves
+		int splitterNum = 0;
+		for (i = first[b]; i < last[b]; i++) {
+			size_t key = (size_t) elems[i] * k + symbol;
+			for (j = predStart[key]; j < predStart[key + 1]; j++)
+				splitter[splitterNum++] = preds[j];
+		}
+		
+		// Mark them inside their blocks
+		int touchedNum = 0;
+		for (i = 0; i < splitterNum; i++) {
+			int p = splitter[i];
+			int y = blockOf[p];
+			if (marked[y] == 0)
+				touched[touchedNum++] = y;
+			
+			int target = first[y] + marked[y];
+			int other = elems[target];
+			elems[target] = p;
+			elems[loc[p]] = other;
+			loc[other] = loc[p];
+			loc[p] = target;
+			marked[y]++;
+		}
+		
+		// Split blocks that are marked partially
+		for (i = 0; i < touchedNum; i++) {
+			int y = touched[i];
+			int count = marked[y];
+			marked[y] = 0;
+			if (count == last[y] - first[y])
+				continue;
+			
+			// Marked states form a new block
+			int z = blocksNum++;
+			first[z] = first[y];
+			last[z] = first[y] + count;
+			first[y] = last[z];
+			for (j = first[z]; j < last[z]; j++)
+				blockOf[elems[j]] = z;
+			
+			for (j = 0; j < k; j++) {
+				int add;
+				if (inWork[(size_t) y * k + j])
+					add = z;
+				else
+					add = (last[z] - first[z]) < (last[y] - first[y]) ? z : y;
+				
+				workBlock[workNum] = add;
+				workSymbol[workNum] = j;
+				workNum++;
+				inWork[(size_t) add * k + j] = 1;
+			}
+		}
+	}
+	
+	// First original state of every block names it
+	for (i = 0; i < blocksNum; i++)
+		repr[i] = -1;
+	for (q = 0; q < a->statesNum; q++)
+		if (repr[blockOf[q]] == -1)
+			repr[blockOf[q]] = q;
+	
+	// Number blocks in breadth-first order from start, skipping the dead one
+	int deadBlock = blockOf[dead];
+	int startBlock = blockOf[a->startStateIndex];
+	for (i = 0; i < blocksNum; i++)
+		minIndex[i] = -1;
+	
+	int orderNum = 0;
+	order[orderNum++] = startBlock;
+	minIndex[startBlock] = 0;
+	for (i = 0; i < orderNum; i++) {
+		int r = repr[order[i]];
+		for (j = 0; j < k; j++) {
+			int to = blockOf[delta[(size_t) r * k + j]];
+			if (to != deadBlock && minIndex[to] == -1) {
+				minIndex[to] = orderNum;
+				order[orderNum++] = to;
+			}
+		}
+	}
+	
+	// Build minimal automaton
+	InitAutomaton(m);
+	m->transitionsNum = k;
+	memcpy(m->transitions, a->transitions, k);
+	for (i = 0; i < orderNum; i++) {
+		int r = repr[order[i]];
+		if (AddState(m, StateName(a, r)) || IndexState(m)) {
+			fprintf(stderr, "Cannot store state %s!\n", StateName(a, r));
+			FreeAutomaton(m);
+			goto done;
+		}
+		m->finishState[i] = a->finishState[r];
+	}
+	m->startStateIndex = 0;
+	
+	m->transitionTable = (int *) malloc(((size_t) orderNum * k + 1) * sizeof(int));
+	if (m->transitionTable == NULL) {
+		fprintf(stderr, "Not enough memory for transition table!\n");
+		FreeAutomaton(m);
+		goto done;
+	}
+	for (i = 0; i < orderNum; i++) {
+		int r = repr[order[i]];
+		for (j = 0; j < k; j++) {
+			int to = blockOf[delta[(size_t) r * k + j]];
+			m->transitionTable[(size_t) i * k + j] = to == deadBlock ? -1 : minIndex[to];
+		}
+	}
+	
+	res = 0;
+	
+done:
+	free(delta);
+	free(predStart);
+	free(preds);
+	free(elems);
+	free(loc);
+	free(blockOf);
+	free(first);
+	free(last);
+	free(marked);
+	free(touched);
+	free(splitter);
+	free(workBlock);
+	free(workSymbol);
+	free(inWork);
+	free(order);
+	free(minIndex);
+	free(repr);
+	return res;
+}
+
+// This function returns next state of compiled automaton
+// It is meant for code outside of simulation loops that does not care about table width
+unsigned int CompiledNext(const CompiledAutomaton * c, unsigned int state, unsigned char symbol) {
+	size_t idx = ((size_t) state << c->rowShift) + c->byteClass[symbol];
+	
+	switch (c->stateWidth) {
+		case 1:
+		return ((const uint8_t *) c->table)[idx];
+		
+		case 2:
+		return ((const uint16_t *) c->table)[idx];
+		
+		default:
+		return ((const uint32_t *) c->table)[idx];
+	}
+}
+
+// This function stores transition of compiled automaton for a class of bytes
+void CompiledSet(CompiledAutomaton * c, unsigned int state, int byteClass, unsigned int nextState) {
+	size_t idx = ((size_t) state << c->rowShift) + byteClass;
+	
+	switch (c->stateWidth) {
+		case 1:
+		((uint8_t *) c->table)[idx] = (uint8_t) nextState;
+		break;
+		
+		case 2:
+		((uint16_t *) c->table)[idx] = (uint16_t) nextState;
+		break;
+		
+		default:
+		((uint32_t *) c->table)[idx] = (uint32_t) nextState;
+		break;
+	}
+}
+
+// This function checks if state of compiled automaton is finishing one
+int IsFinishState(const CompiledAutomaton * c, size_t state) {
+	return (c->finishBits[state / 8] >> (state % 8)) & 1;
+}
+
+// This function fills bit matrix of symbol set from symbolValid
+void BuildSymbolBits(CompiledAutomaton * c) {
+	int b;
+	
+	memset(c->symbolBitsLow, 0, sizeof(c->symbolBitsLow));
+	memset(c->symbolBitsHigh, 0, sizeof(c->symbolBitsHigh));
+	for (b = 0; b < 256; b++)
+		if (c->symbolValid[b]) {
+			if (b < 128)
+				c->symbolBitsLow[b % 16] |= (uint8_t) (1 << (b / 16));
+			else
+				c->symbolBitsHigh[b % 16] |= (uint8_t) (1 << (b / 16 - 8));
+		}
+}
+
+// This function builds permutations of small automaton from its table, they are not kept in binary file
+// Returns 0 on success, 1 on failure
+int BuildStatePermutations(CompiledAutomaton * c) {
+	int s, b;
+	
+	if (c->statesNum > ENUM_STATES)
+		return 0;
+	
+	c->statePermutations = (uint8_t *) malloc((size_t) c->classesNum * ENUM_STATES);
+	if (c->statePermutations == NULL)
+		return 1;
+	
+	// Unused bytes keep their states
+	for (b = 0; b < 256; b++)
+		for (s = 0; s < ENUM_STATES; s++)
+			c->statePermutations[c->byteClass[b] * ENUM_STATES + s] =
+				(uint8_t) (s < c->statesNum ? CompiledNext(c, s, (unsigned char) b) : (unsigned int) s);
+	return 0;
+}
+
+// This function releases all resources of compiled automaton
+void FreeCompiledAutomaton(CompiledAutomaton * c) {
+	if (c->builtin) {
+		// Arrays are part of the program
+	} else if (c->image != NULL) {
+		// Every array lives in binary file image
+#ifdef HAVE_MMAP
+		munmap(c->image, c->imageSize);
+#else
+		free(c->image);
+#endif
+	} else {
+		free(c->table);
+		free(c->finishBits);
+		free(c->names);
+		free(c->nameOffsets);
+	}
+	free(c->statePermutations);
+#ifdef HAVE_JIT
+	if (c->nativeCode != NULL)
+		munmap(c->nativeCode, c->nativeSize);
+#endif
+	
+	c->image = NULL;
+	c->source = NULL;
+	c->sourceSize = 0;
+	c->matchRecord = NULL;
+	c->nativeCode = NULL;
+	c->statePermutations = NULL;
+	c->table = NULL;
+	c->finishBits = NULL;
+	c->names = NULL;
+	c->nameOffsets = NULL;
+}
+
+// This function builds execution form of loaded automaton
+// Returns 0 on success, 1 on failure
+int CompileAutomaton(Automaton * a, CompiledAutomaton * c) {
+	int i, b;
+	
+	c->statesNum = a->statesNum + 2;
+	c->deadState = a->statesNum;
+	c->wrongSymbolState = a->statesNum + 1;
+	
+	int * newIndex = (int *) calloc(a->statesNum + 1, sizeof(int));
+	if (newIndex == NULL) {
+		fprintf(stderr, "Not enough memory for transition table!\n");
+		return 1;
+	}
+	
+	// Finishing states that loop to themselves on every symbol accept anything after them.
+	// They go last, right before dead state
+	int absorbingNum = 0;
+	for (i = 0; i < a->statesNum; i++) {
+		int absorbing = a->finishState[i];
+		for (b = 0; b < a->transitionsNum && absorbing; b++)
+			if (a->transitionTable[(size_t) i * a->transitionsNum + b] != i)
+				absorbing = 0;
+		newIndex[i] = absorbing ? -1 : i - absorbingNum;
+		absorbingNum += absorbing;
+	}
+	
+	c->stopState = a->statesNum - absorbingNum;
+	int nextAbsorbing = c->stopState;
+	for (i = 0; i < a->statesNum; i++)
+		if (newIndex[i] == -1)
+			newIndex[i] = nextAbsorbing++;
+	c->startState = newIndex[a->startStateIndex];
+	
+	// Symbols that lead to the same states from every state share a class,
+	// columns are compared by hash first
+	int symbolClass[MAX_SYMBOLS];
+	int classSymbol[MAX_SYMBOLS + 1];
+	uint64_t columnHash[MAX_SYMBOLS];
+	int k = a->transitionsNum;
+	int j, cl;
+	
+	for (j = 0; j < k; j++) {
+		columnHash[j] = 14695981039346656037ull;
+		for (i = 0; i < a->statesNum; i++)
+			columnHash[j] = (columnHash[j] ^ (uint32_t) a->transitionTable[(size_t) i * k + j]) * 1099511628211ull;
+	}
+	
+	// Class 0 is kept for bytes out of symbol set, when there are some
+	int firstClass = k < 256 ? 1 : 0;
+	c->classesNum = firstClass;
+	for (j = 0; j < k; j++) {
+		symbolClass[j] = -1;
+		for (cl = firstClass; cl < c->classesNum && symbolClass[j] == -1; cl++) {
+			int other = classSymbol[cl];
+			if (columnHash[other] != columnHash[j])
+				continue;
+			
+			for (i = 0; i < a->statesNum; i++)
+				if (a->transitionTable[(size_t) i * k + j] != a->transitionTable[(size_t) i * k + other])
+					break;
+			if (i == a->statesNum)
+				symbolClass[j] = cl;
+		}
+		
+		if (symbolClass[j] == -1) {
+			classSymbol[c->classesNum] = j;
+			symbolClass[j] = c->classesNum++;
+		}
+	}
+	
+	memset(c->byteClass, 0, sizeof(c->byteClass));
+	for (j = 0; j < k; j++)
+		c->byteClass[(unsigned char) a->transitions[j]] = (uint8_t) symbolClass[j];
+	
+	c->rowShift = 0;
+	while ((1 << c->rowShift) < c->classesNum)
+		c->rowShift++;
+	size_t rowSize = (size_t) 1 << c->rowShift;
+	
+	// Choose the narrowest entry that fits every state index
+	if (c->statesNum <= 0x100)
+		c->stateWidth = 1;
+	else if (c->statesNum <= 0x10000)
+		c->stateWidth = 2;
+	else
+		c->stateWidth = 4;
+	
+	size_t finishSize = (c->statesNum + 7) / 8;
+	c->source = NULL;
+	c->sourceSize = 0;
+	c->image = NULL;
+	c->imageSize = 0;
+	c->statePermutations = NULL;
+	c->builtin = 0;
+	c->matchRecord = NULL;
+	c->nativeCode = NULL;
+	c->table = malloc((size_t) c->statesNum * rowSize * c->stateWidth);
+	c->finishBits = (uint8_t *) calloc(finishSize, 1);
+	c->names = (char *) malloc(a->namePool.length + 1);
+	c->nameOffsets = (uint64_t *) malloc((a->statesNum + 1) * sizeof(uint64_t));
+	if (c->table == NULL || c->finishBits == NULL || c->names == NULL || c->nameOffsets == NULL) {
+		fprintf(stderr, "Not enough memory for transition table!\n");
+		FreeCompiledAutomaton(c);
+		free(newIndex);
+		return 1;
+	}
+	
+	// Mark bytes of symbol set
+	memset(c->symbolValid, 0, sizeof(c->symbolValid));
+	for (i = 0; i < a->transitionsNum; i++)
+		c->symbolValid[(unsigned char) a->transitions[i]] = 1;
+	BuildSymbolBits(c);
+	
+	// By default known symbols lead to dead state and unknown ones to wrong symbol state
+	// Neither of them is finishing state. Unused entries at row ends are filled too
+	for (i = 0; i < c->statesNum; i++)
+		for (cl = 0; cl < (int) rowSize; cl++)
+			CompiledSet(c, i, cl, cl >= firstClass && cl < c->classesNum ? c->deadState : c->wrongSymbolState);
+	for (cl = 0; cl < (int) rowSize; cl++)
+		CompiledSet(c, c->wrongSymbolState, cl, c->wrongSymbolState);
+	for (i = 0; i < a->statesNum; i++)
+		if (a->finishState[i])
+			c->finishBits[newIndex[i] / 8] |= (uint8_t) (1 << (newIndex[i] % 8));
+	
+	// Keep names of states
+	c->namesSize = a->namePool.length;
+	if (c->namesSize > 0)
+		memcpy(c->names, a->namePool.data, c->namesSize);
+	for (i = 0; i < a->statesNum; i++)
+		c->nameOffsets[newIndex[i]] = a->statesNames[i];
+	
+	// Copy loaded transitions into columns of their symbols
+	for (i = 0; i < a->statesNum; i++)
+		for (b = 0; b < a->transitionsNum; b++) {
+			int toIndex = a->transitionTable[(size_t) i * a->transitionsNum + b];
+			if (toIndex != -1)
+				CompiledSet(c, newIndex[i], symbolClass[b], newIndex[toIndex]);
+		}
+	
+	free(newIndex);
+	if (BuildStatePermutations(c)) {
+		fprintf(stderr, "Not enough memory for transition table!\n");
+		FreeCompiledAutomaton(c);
+		return 1;
+	}
+	return 0;
+}
+
+// This function rounds file offset up to alignment of binary file sections
+uint64_t AlignOffset(uint64_t offset) {
+	return (offset + BINARY_ALIGN - 1) / BINARY_ALIGN * BINARY_ALIGN;
+}
+
+// This function writes section of binary file at given offset, padding the gap before it with zeros
+// Returns 0 on success, 1 on failure
+int WriteSection(FILE * f, uint64_t * position, uint64_t offset, const void * data, size_t size) {
+	static const char zeros[BINARY_ALIGN] = { 0 };
+	
+	while (*position < offset) {
+		size_t gap = offset - *position < BINARY_ALIGN ? (size_t) (offset - *position) : BINARY_ALIGN;
+		if (fwrite(zeros, 1, gap, f) != gap)
+			return 1;
+		*position += gap;
+	}
+	
+	if (size > 0 && fwrite(data, 1, size, f) != size)
+		return 1;
+	*position += size;
+	
+	return 0;
+}
+
+// This function writes compiled automaton to opened binary file and closes it
+// Returns 0 on success, 1 on failure
+int WriteCompiledAutomaton(const CompiledAutomaton * c, FILE * f) {
+	BinaryHeader h;
+	memset(&h, 0, sizeof(h));
+	
+	memcpy(h.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC));
+	h.version = BINARY_VERSION;
+	h.byteOrder = 1;
+	h.statesNum = c->statesNum;
+	h.startState = c->startState;
+	h.deadState = c->deadState;
+	h.wrongSymbolState = c->wrongSymbolState;
+	h.stateWidth = c->stateWidth;
+	h.stopState = c->stopState;
+	h.classesNum = c->classesNum;
+	h.rowShift = c->rowShift;
+	memcpy(h.symbolValid, c->symbolValid, 256);
+	memcpy(h.byteClass, c->byteClass, 256);
+	
+	// Lay sections out one after another
+	size_t tableSize = ((size_t) c->statesNum << c->rowShift) * c->stateWidth;
+	size_t finishSize = (c->statesNum + 7) / 8;
+	size_t nameOffsetsSize = (size_t) (c->statesNum - 2) * sizeof(uint64_t);
+	h.tableOffset = AlignOffset(sizeof(h));
+	h.finishOffset = AlignOffset(h.tableOffset + tableSize);
+	h.nameOffsetsOffset = AlignOffset(h.finishOffset + finishSize);
+	h.namesOffset = AlignOffset(h.nameOffsetsOffset + nameOffsetsSize);
+	h.namesSize = c->namesSize;
+	h.sourceOffset = h.namesOffset + h.namesSize;
+	h.sourceSize = c->sourceSize;
+	h.fileSize = h.sourceOffset + h.sourceSize;
+	
+	uint64_t position = 0;
+	int failed = WriteSection(f, &position, 0, &h, sizeof(h))
+		|| WriteSection(f, &position, h.tableOffset, c->table, tableSize)
+		|| WriteSection(f, &position, h.finishOffset, c->finishBits, finishSize)
+		|| WriteSection(f, &position, h.nameOffsetsOffset, c->nameOffsets, nameOffsetsSize)
+		|| WriteSection(f, &position, h.namesOffset, c->names, c->namesSize)
+		|| WriteSection(f, &position, h.sourceOffset, c->source, c->sourceSize);
+	
+	return fclose(f) != 0 || failed;
+}
+
+// This function saves compiled automaton to binary file that can be loaded without parsing
+// Returns 0 on success, 1 on failure
+int SaveCompiledAutomaton(const CompiledAutomaton * c, const char * path) {
+	FILE * f = fopen(path, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot create file %s\n", path);
+		return 1;
+	}
+	
+	if (WriteCompiledAutomaton(c, f)) {
+		fprintf(stderr, "Cannot write file %s\n", path);
+		return 1;
+	}
+	
+	return 0;
+}
+
+// This function checks if file starts with magic string of compiled automaton
+int IsCompiledAutomatonFile(const char * path) {
+	char magic[8];
+	FILE * f = fopen(path, "rb");
+	if (f == NULL)
+		return 0;
+	
+	int res = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, BINARY_MAGIC, sizeof(BINARY_MAGIC)) == 0;
+	fclose(f);
+	return res;
+}
+
+// This function checks that section of 'length' bytes at 'offset' fits into file of 'size' bytes
+int SectionFits(uint64_t offset, uint64_t length, uint64_t size) {
+	return offset <= size && length <= size - offset;
+}
+
+// This function checks contents of loaded compiled automaton that simulation loops index with:
+// every table entry and offsets of state names. It reads the whole table, a few milliseconds
+// for tens of megabytes, so it is done for files from cache that anyone may have put there
+// and for small automata only
+// Returns 0 if they are valid, 1 otherwise
+int CheckCompiledContents(const CompiledAutomaton * c) {
+	size_t entries = (size_t) c->statesNum << c->rowShift;
+	size_t i;
+	
+	// The largest entry is found with loops simple enough to be vectorized
+	uint32_t largest = 0;
+	if (c->stateWidth == 1) {
+		const uint8_t * table = (const uint8_t *) c->table;
+		uint8_t m = 0;
+		for (i = 0; i < entries; i++)
+			m = table[i] > m ? table[i] : m;
+		largest = m;
+	} else if (c->stateWidth == 2) {
+		const uint16_t * table = (const uint16_t *) c->table;
+		uint16_t m = 0;
+		for (i = 0; i < entries; i++)
+			m = table[i] > m ? table[i] : m;
+		largest = m;
+	} else {
+		const uint32_t * table = (const uint32_t *) c->table;
+		for (i = 0; i < entries; i++)
+			largest = table[i] > largest ? table[i] : largest;
+	}
+	if (largest >= (uint32_t) c->statesNum)
+		return 1;
+	
+	// Every name ends within names block
+	if (c->statesNum > 2 && (c->namesSize == 0 || c->names[c->namesSize - 1] != '\0'))
+		return 1;
+	for (i = 0; i < (size_t) c->statesNum - 2; i++)
+		if (c->nameOffsets[i] >= c->namesSize)
+			return 1;
+	
+	return 0;
+}
+
+// This function loads compiled automaton from binary file
+// The file is mapped into memory and used in place: nothing is parsed and only header is
+// checked, so loading does not depend on size of the table. With 'cached' set the file comes
+// from cache and its contents are checked too, see CheckCompiledContents. On POSIX systems
+// it must then be a regular file of the user, checked on the opened file so that it cannot be
+// swapped after the check, and files that are missing or cannot be used are not reported
+// Returns 0 on success, 1 on failure
+int LoadCompiledAutomaton(CompiledAutomaton * c, const char * path, int cached) {
+	size_t size;
+	void * image;
+	
+#ifdef HAVE_MMAP
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		if (!cached)
+			fprintf(stderr, "File not found or could not be opened: %s\n", path);
+		if (fd != -1)
+			close(fd);
+		return 1;
+	}
+	
+	// No one else may put automata into cache in the name of the user
+	if (cached && (!S_ISREG(st.st_mode) || st.st_uid != getuid())) {
+		close(fd);
+		return 1;
+	}
+	
+	size = (size_t) st.st_size;
+	image = size >= sizeof(BinaryHeader) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (image == MAP_FAILED) {
+		if (!cached)
+			fprintf(stderr, "Cannot map compiled automaton %s\n", path);
+		return 1;
+	}
+#else
+	FILE * f = fopen(path, "rb");
+	if (f == NULL) {
+		if (!cached)
+			fprintf(stderr, "File not found or could not be opened: %s\n", path);
+		return 1;
+	}
+	
+	fseek(f, 0, SEEK_END);
+	size = (size_t) ftell(f);
+	fseek(f, 0, SEEK_SET);
+	image = malloc(size > 0 ? size : 1);
+	if (image == NULL || fread(image, 1, size, f) != size) {
+		fprintf(stderr, "Cannot read compiled automaton %s\n", path);
+		free(image);
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+#endif
+	
+	c->image = image;
+	c->imageSize = size;
+	c->statePermutations = NULL;
+	c->builtin = 0;
+	c->matchRecord = NULL;
+	c->nativeCode = NULL;
+	
+	// Check that header describes this file and sections fit into it
+	const BinaryHeader * h = (const BinaryHeader *) image;
+	int valid = size >= sizeof(BinaryHeader) && h->rowShift <= 8;
+	uint64_t tableSize = valid ? ((uint64_t) h->statesNum << h->rowShift) * h->stateWidth : 0;
+	valid = valid
+		&& memcmp(h->magic, BINARY_MAGIC, sizeof(BINARY_MAGIC)) == 0
+		&& h->version == BINARY_VERSION
+		&& h->byteOrder == 1
+		&& h->fileSize == size
+		&& (h->stateWidth == 1 || h->stateWidth == 2 || h->stateWidth == 4)
+		&& h->statesNum >= 2 && h->statesNum <= 0x7fffffff
+		&& h->startState < h->statesNum
+		&& h->deadState == h->statesNum - 2
+		&& h->wrongSymbolState == h->statesNum - 1
+		&& h->stopState <= h->deadState
+		&& h->classesNum >= 1 && h->classesNum <= ((uint32_t) 1 << h->rowShift)
+		&& h->tableOffset % BINARY_ALIGN == 0
+		&& SectionFits(h->tableOffset, tableSize, size)
+		&& SectionFits(h->finishOffset, ((uint64_t) h->statesNum + 7) / 8, size)
+		&& h->nameOffsetsOffset % BINARY_ALIGN == 0
+		&& SectionFits(h->nameOffsetsOffset, (uint64_t) (h->statesNum - 2) * sizeof(uint64_t), size)
+		&& SectionFits(h->namesOffset, h->namesSize, size)
+		&& SectionFits(h->sourceOffset, h->sourceSize, size);
+	
+	int b;
+	for (b = 0; valid && b < 256; b++)
+		valid = h->byteClass[b] < h->classesNum;
+	
+	if (!valid) {
+		if (!cached)
+			fprintf(stderr, "Compiled automaton %s is damaged or has other version\n", path);
+		FreeCompiledAutomaton(c);
+		return 1;
+	}
+	
+	char * base = (char *) image;
+	c->statesNum = h->statesNum;
+	c->startState = h->startState;
+	c->deadState = h->deadState;
+	c->wrongSymbolState = h->wrongSymbolState;
+	c->stopState = h->stopState;
+	c->stateWidth = h->stateWidth;
+	c->classesNum = h->classesNum;
+	c->rowShift = h->rowShift;
+	memcpy(c->symbolValid, h->symbolValid, 256);
+	memcpy(c->byteClass, h->byteClass, 256);
+	BuildSymbolBits(c);
+	c->table = base + h->tableOffset;
+	c->finishBits = (uint8_t *) (base + h->finishOffset);
+	c->nameOffsets = (uint64_t *) (base + h->nameOffsetsOffset);
+	c->names = base + h->namesOffset;
+	c->namesSize = h->namesSize;
+	c->source = h->sourceSize > 0 ? base + h->sourceOffset : NULL;
+	c->sourceSize = h->sourceSize;
+	
+	// Tables of small automata are read anyway to build permutations
+	if ((cached || c->statesNum <= ENUM_STATES) && CheckCompiledContents(c)) {
+		if (!cached)
+			fprintf(stderr, "Compiled automaton %s is damaged or has other version\n", path);
+		FreeCompiledAutomaton(c);
+		return 1;
+	}
+	
+	if (BuildStatePermutations(c)) {
+		fprintf(stderr, "Not enough memory for transition table!\n");
+		FreeCompiledAutomaton(c);
+		return 1;
+	}
+	return 0;
+}
+
+// This function writes C symbol for a byte in generated code
+void WriteByteLiteral(FILE * f, int b) {
+	if (isgraph(b) && b != '\'' && b != '\\')
+		fprintf(f, "'%c'", b);
+	else
+		fprintf(f, "%d", b);
+}
+
+// This function writes array of numbers to generated header
+void WriteArray(FILE * f, const char * type, const char * name, const void * data, size_t count, int width) {
+	size_t i;
+	
+	fprintf(f, "static const %s %s[%lu] = {", type, name, (unsigned long) (count > 0 ? count : 1));
+	for (i = 0; i < count; i++) {
+		unsigned long long value;
+		if (width == 1)
+			value = ((const uint8_t *) data)[i];
+		else if (width == 2)
+			value = ((const uint16_t *) data)[i];
+		else if (width == 4)
+			value = ((const uint32_t *) data)[i];
+		else
+			value = ((const uint64_t *) data)[i];
+		
+		fprintf(f, "%s%llu%s", i % 16 == 0 ? "\n\t" : " ", value, i + 1 < count ? "," : "");
+	}
+	fprintf(f, "%s\n};\n\n", count > 0 ? "" : "\n\t0");
+}
+
+// This function writes jump of generated matcher to the block of 'state'. Deciding states
+// jump to shared blocks, 'decidingUsed' marks the ones that are needed
+void WriteJump(FILE * f, const CompiledAutomaton * c, int state, int * decidingUsed) {
+	if (state < c->stopState) {
+		fprintf(f, "goto state%d;\n", state);
+	} else {
+		int accept = IsFinishState(c, state);
+		fprintf(f, "goto %s;\n", accept ? "accept" : "reject");
+		decidingUsed[accept ? 0 : 1] = 1;
+	}
+}
+
+// This function writes compiled automaton as C header that builds it into the program.
+// Header holds the arrays of compiled automaton, so nothing is loaded at run time, and
+// BuiltinRecord matcher with a block of code for every state: a switch on the next byte
+// jumps straight to the block of the next state
+// Returns 0 on success, 1 on failure
+int GenerateAutomatonHeader(const CompiledAutomaton * c, const char * source, const char * path) {
+	static const char * entryTypes[5] = { NULL, "uint8_t", "uint16_t", NULL, "uint32_t" };
+	int s, cl, b;
+	
+	FILE * f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot create file %s\n", path);
+		return 1;
+	}
+	
+	fprintf(f, "// Automaton %s built into Simulator, generated with -g\n", source);
+	fprintf(f, "// Compile Simulator with -DDFSM_BUILTIN_HEADER='\"%s\"' and run it with -b\n\n", path);
+	fprintf(f, "#define BUILTIN_STATES_NUM %d\n", c->statesNum);
+	fprintf(f, "#define BUILTIN_START_STATE %d\n", c->startState);
+	fprintf(f, "#define BUILTIN_STOP_STATE %d\n", c->stopState);
+	fprintf(f, "#define BUILTIN_CLASSES_NUM %d\n", c->classesNum);
+	fprintf(f, "#define BUILTIN_ROW_SHIFT %d\n", c->rowShift);
+	fprintf(f, "#define BUILTIN_STATE_WIDTH %d\n", c->stateWidth);
+	fprintf(f, "#define BUILTIN_NAMES_SIZE %lu\n\n", (unsigned long) c->namesSize);
+	
+	WriteArray(f, entryTypes[c->stateWidth], "BuiltinTable", c->table,
+		(size_t) c->statesNum << c->rowShift, c->stateWidth);
+	WriteArray(f, "uint8_t", "BuiltinFinishBits", c->finishBits, (c->statesNum + 7) / 8, 1);
+	WriteArray(f, "char", "BuiltinSymbolValid", c->symbolValid, 256, 1);
+	WriteArray(f, "uint8_t", "BuiltinByteClass", c->byteClass, 256, 1);
+	WriteArray(f, "uint8_t", "BuiltinNames", c->names, c->namesSize, 1);
+	WriteArray(f, "uint64_t", "BuiltinNameOffsets", c->nameOffsets, c->statesNum - 2, 8);
+	
+	fprintf(f, "// Returns 0 if record from 'str' to 'end' is accepted, 1 if it is rejected\n");
+	fprintf(f, "// and 2 if it has wrong symbol\n");
+	fprintf(f, "static int BuiltinRecord(const unsigned char * str, const unsigned char * end) {\n");
+	
+	// Deciding states share two blocks that only check symbols of the rest of record
+	int decidingUsed[2] = { 0, 0 };
+	fprintf(f, "\t");
+	WriteJump(f, c, c->startState, decidingUsed);
+	
+	int target[MAX_SYMBOLS + 1];
+	for (s = 0; s < c->stopState; s++) {
+		fprintf(f, "\nstate%d:\n", s);
+		fprintf(f, "\tif (str == end)\n\t\treturn %d;\n", IsFinishState(c, s) ? 0 : 1);
+		fprintf(f, "\tswitch (*str++) {\n");
+		
+		for (cl = 0; cl < c->classesNum; cl++)
+			target[cl] = c->wrongSymbolState;
+		for (b = 0; b < 256; b++)
+			target[c->byteClass[b]] = CompiledNext(c, s, (unsigned char) b);
+		
+		// Bytes of classes that go to the same state share a branch, wrong symbols go to default
+		for (cl = 0; cl < c->classesNum; cl++) {
+			int next = target[cl], other, count = 0;
+			for (other = 0; other < cl && target[other] != next; other++)
+				;
+			if (other < cl || next == c->wrongSymbolState)
+				continue;
+			
+			for (b = 0; b < 256; b++)
+				if (c->symbolValid[b] && target[c->byteClass[b]] == next) {
+					fprintf(f, "%s", count == 0 ? "\t\tcase " : (count % 8 == 0 ? ":\n\t\tcase " : ": case "));
+					WriteByteLiteral(f, b);
+					count++;
+				}
+			fprintf(f, ":\n\t\t");
+			WriteJump(f, c, next, decidingUsed);
+		}
+		fprintf(f, "\t\tdefault:\n\t\treturn 2;\n\t}\n");
+	}
+	
+	if (decidingUsed[0])
+		fprintf(f, "\naccept:\n\twhile (str < end)\n\t\tif (!BuiltinSymbolValid[*str++])\n\t\t\treturn 2;\n\treturn 0;\n");
+	if (decidingUsed[1])
+		fprintf(f, "\nreject:\n\twhile (str < end)\n\t\tif (!BuiltinSymbolValid[*str++])\n\t\t\treturn 2;\n\treturn 1;\n");
+	fprintf(f, "}\n");
+	
+	if (fclose(f) != 0) {
+		fprintf(stderr, "Cannot write file %s\n", path);
+		return 1;
+	}
+	
+	return 0;
+}
+
+#ifdef DFSM_BUILTIN_HEADER
+// This function sets compiled automaton up from arrays of the header built into the program
+// Returns 0 on success, 1 on failure
+int InitBuiltinAutomaton(CompiledAutomaton * c) {
+	c->statesNum = BUILTIN_STATES_NUM;
+	c->startState = BUILTIN_START_STATE;
+	c->deadState = BUILTIN_STATES_NUM - 2;
+	c->wrongSymbolState = BUILTIN_STATES_NUM - 1;
+	c->stopState = BUILTIN_STOP_STATE;
+	c->stateWidth = BUILTIN_STATE_WIDTH;
+	c->classesNum = BUILTIN_CLASSES_NUM;
+	c->rowShift = BUILTIN_ROW_SHIFT;
+	memcpy(c->symbolValid, BuiltinSymbolValid, 256);
+	memcpy(c->byteClass, BuiltinByteClass, 256);
+	BuildSymbolBits(c);
+	c->table = (void *) BuiltinTable;
+	c->finishBits = (uint8_t *) BuiltinFinishBits;
+	c->nameOffsets = (uint64_t *) BuiltinNameOffsets;
+	c->names = (char *) BuiltinNames;
+	c->namesSize = BUILTIN_NAMES_SIZE;
+	c->source = NULL;
+	c->sourceSize = 0;
+	c->image = NULL;
+	c->imageSize = 0;
+	c->statePermutations = NULL;
+	c->builtin = 1;
+	c->matchRecord = BuiltinRecord;
+	c->nativeCode = NULL;
+	
+	if (BuildStatePermutations(c)) {
+		fprintf(stderr, "Not enough memory for transition table!\n");
+		return 1;
+	}
+	return 0;
+}
+#endif
+
+#ifdef HAVE_JIT
+// Shared blocks of native code, their labels follow labels of states before stopState
+#define NATIVE_ACCEPT 0
+#define NATIVE_REJECT 1
+#define NATIVE_WRONG_SYMBOL 2
+#define NATIVE_RETURN_ACCEPTED 3
+#define NATIVE_RETURN_REJECTED 4
+#define NATIVE_SHARED_BLOCKS 5
+
+// Place in native code that refers to a label
+typedef struct {
+	// Offset of the reference in code
+	size_t offset;
+	
+	// Index of the label
+	int label;
+	
+	// Set for 8-byte absolute address, otherwise it is 4-byte offset from the end of reference
+	int absolute;
+} NativeFixup;
+
+// Native code being generated
+typedef struct {
+	ByteBuffer code;
+	
+	// Array of NativeFixup
+	ByteBuffer fixups;
+	
+	// Code offset of every label
+	size_t * labels;
+	
+	// Set when memory ran out
+	int failed;
+} NativeBuilder;
+
+// This function appends bytes of instruction to native code
+void NativeBytes(NativeBuilder * n, const char * bytes, size_t size) {
+	n->failed |= BufferAppend(&n->code, bytes, size);
+}
+
+// This function appends reference to a label, it is filled once code is placed
+void NativeReference(NativeBuilder * n, int label, int absolute) {
+	static const char zeros[8] = { 0 };
+	NativeFixup fixup;
+	
+	fixup.offset = n->code.length;
+	fixup.label = label;
+	fixup.absolute = absolute;
+	n->failed |= BufferAppend(&n->fixups, (const char *) &fixup, sizeof(fixup));
+	NativeBytes(n, zeros, absolute ? 8 : 4);
+}
+
+// This function returns label of the code that continues from 'state'
+int NativeStateLabel(const CompiledAutomaton * c, size_t state) {
+	if (state < (size_t) c->stopState)
+		return (int) state;
+	if (state == (size_t) c->wrongSymbolState)
+		return c->stopState + NATIVE_WRONG_SYMBOL;
+	return c->stopState + (IsFinishState(c, state) ? NATIVE_ACCEPT : NATIVE_REJECT);
+}
+
+// This function compiles automaton into x86-64 machine code that becomes its matchRecord.
+// Every state before stopState is a block of code: record end returns the result, otherwise the
+// next byte is compared with every symbol or looked up in a table of jumps by its class, and
+// the block of the next state is entered directly. Deciding states share blocks that only check
+// symbols of the rest of record. Code follows System V calling convention: record bounds come
+// in rdi and rsi, result is returned in eax; byte classes are addressed through r8, so
+// the automaton structure must stay in place while the code is used. Jumps are relative,
+// so code of more than 2 GB is not made
+// Returns 0 on success, 1 on failure
+int CompileNative(CompiledAutomaton * c) {
+	NativeBuilder n;
+	int labelsNum = c->stopState + NATIVE_SHARED_BLOCKS;
+	int s, b, i;
+	
+	memset(&n, 0, sizeof(n));
+	n.labels = (size_t *) malloc(labelsNum * sizeof(size_t));
+	if (n.labels == NULL)
+		return 1;
+	
+	int symbolsNum = 0;
+	for (b = 0; b < 256; b++)
+		symbolsNum += c->symbolValid[b];
+	
+	// Entry: mov r8, byteClass; jmp start
+	const uint8_t * byteClass = c->byteClass;
+	NativeBytes(&n, "\x49\xb8", 2);
+	NativeBytes(&n, (const char *) &byteClass, 8);
+	NativeBytes(&n, "\xe9", 1);
+	NativeReference(&n, NativeStateLabel(c, c->startState), 0);
+	
+	for (s = 0; s < c->stopState; s++) {
+		n.labels[s] = n.code.length;
+		
+		// cmp rdi, rsi; je return; movzx eax, byte [rdi]; inc rdi
+		NativeBytes(&n, "\x48\x39\xf7\x0f\x84", 5);
+		NativeReference(&n, c->stopState + (IsFinishState(c, s) ? NATIVE_RETURN_ACCEPTED : NATIVE_RETURN_REJECTED), 0);
+		NativeBytes(&n, "\x0f\xb6\x07\x48\xff\xc7", 6);
+		
+		if (symbolsNum <= NATIVE_CHAIN_SYMBOLS) {
+			// cmp al, symbol; je next ... jmp wrong symbol
+			for (b = 0; b < 256; b++)
+				if (c->symbolValid[b]) {
+					char compare[4] = { '\x3c', (char) b, '\x0f', '\x84' };
+					NativeBytes(&n, compare, 4);
+					NativeReference(&n, NativeStateLabel(c, CompiledNext(c, s, (unsigned char) b)), 0);
+				}
+			NativeBytes(&n, "\xe9", 1);
+			NativeReference(&n, c->stopState + NATIVE_WRONG_SYMBOL, 0);
+		} else {
+			// movzx eax, byte [r8 + rax]; lea rcx, [rip + table]; jmp [rcx + rax * 8]
+			NativeBytes(&n, "\x41\x0f\xb6\x04\x00\x48\x8d\x0d", 8);
+			size_t tableOffset = n.code.length + 4 + 3;
+			size_t padding = (8 - tableOffset % 8) % 8;
+			uint32_t displacement = (uint32_t) (3 + padding);
+			NativeBytes(&n, (const char *) &displacement, 4);
+			NativeBytes(&n, "\xff\x24\xc1", 3);
+			NativeBytes(&n, "\xcc\xcc\xcc\xcc\xcc\xcc\xcc", padding);
+			
+			// Class of a byte is found by any of its bytes. Class 0 of files made by older
+			// versions may have no bytes when every byte is a symbol, it is wrong symbol then
+			int classByte[MAX_SYMBOLS + 1];
+			for (i = 0; i < c->classesNum; i++)
+				classByte[i] = -1;
+			for (b = 255; b >= 0; b--)
+				classByte[c->byteClass[b]] = b;
+			for (i = 0; i < c->classesNum; i++)
+				NativeReference(&n, classByte[i] == -1 ? c->stopState + NATIVE_WRONG_SYMBOL
+					: NativeStateLabel(c, CompiledNext(c, s, (unsigned char) classByte[i])), 1);
+		}
+	}
+	
+	// Accept: mov edx, 0; jmp check. Reject: mov edx, 1
+	n.labels[c->stopState + NATIVE_ACCEPT] = n.code.length;
+	NativeBytes(&n, "\xba\x00\x00\x00\x00\xeb\x05", 7);
+	n.labels[c->stopState + NATIVE_REJECT] = n.code.length;
+	NativeBytes(&n, "\xba\x01\x00\x00\x00", 5);
+	
+	// Check: cmp rdi, rsi; je done; movzx eax, byte [rdi]; inc rdi;
+	// cmp byte [r8 + rax], 0; jne check. Wrong symbol falls through
+	NativeBytes(&n, "\x48\x39\xf7\x74\x13\x0f\xb6\x07\x48\xff\xc7\x41\x80\x3c\x00\x00\x75\xee", 18);
+	
+	// Wrong symbol: mov eax, 2; ret. Done: mov eax, edx; ret
+	n.labels[c->stopState + NATIVE_WRONG_SYMBOL] = n.code.length;
+	NativeBytes(&n, "\xb8\x02\x00\x00\x00\xc3\x89\xd0\xc3", 9);
+	
+	n.labels[c->stopState + NATIVE_RETURN_ACCEPTED] = n.code.length;
+	NativeBytes(&n, "\xb8\x00\x00\x00\x00\xc3", 6);
+	n.labels[c->stopState + NATIVE_RETURN_REJECTED] = n.code.length;
+	NativeBytes(&n, "\xb8\x01\x00\x00\x00\xc3", 6);
+	
+	// Relative jumps reach 2 GB, larger code is not made
+	void * code = MAP_FAILED;
+	if (!n.failed && n.code.length <= INT32_MAX)
+		code = mmap(NULL, n.code.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	
+	if (code != MAP_FAILED) {
+		// Fill references now that addresses are known, then make code executable
+		char * base = (char *) code;
+		const NativeFixup * fixups = (const NativeFixup *) n.fixups.data;
+		size_t fixupsNum = n.fixups.length / sizeof(NativeFixup);
+		size_t f;
+		
+		memcpy(base, n.code.data, n.code.length);
+		for (f = 0; f < fixupsNum; f++) {
+			if (fixups[f].absolute) {
+				uint64_t address = (uint64_t) (uintptr_t) (base + n.labels[fixups[f].label]);
+				memcpy(base + fixups[f].offset, &address, 8);
+			} else {
+				int32_t offset = (int32_t) (n.labels[fixups[f].label] - (fixups[f].offset + 4));
+				memcpy(base + fixups[f].offset, &offset, 4);
+			}
+		}
+		
+		if (mprotect(code, n.code.length, PROT_READ | PROT_EXEC) == 0) {
+			c->nativeCode = code;
+			c->nativeSize = n.code.length;
+			// Object pointer is copied into function pointer, which POSIX allows
+			memcpy(&c->matchRecord, &code, sizeof(code));
+		} else {
+			munmap(code, n.code.length);
+		}
+	}
+	
+	free(n.code.data);
+	free(n.fixups.data);
+	free(n.labels);
+	return c->nativeCode != NULL ? 0 : 1;
+}
+#endif
+
+// Debug automaton print
+void PrintAutomaton(Automaton * a) {
+	int i,j;
+	
+	printf("Start state: %s\n", StateName(a, a->startStateIndex));
+	
+	printf("End states:  ");
+	for (i = 0; i < a->statesNum; i++)
 		if (a->finishState[i] == 1)
-			printf("%s ", a->statesNames[i]);
+			printf("%s ", StateName(a, i));
+	printf("\n");
+	
+	printf("All states:  ");
+	for (i = 0; i < a->statesNum; i++)
+		printf("%s ", StateName(a, i));
+	printf("\n");
+	
+	printf("Symbols:     ");
+	for (i = 0; i < a->transitionsNum; i++)
+		printf("%c ", a->transitions[i]);
 	printf("\n");
 	
-	printf("All states:  ");
-	for (i = 0; i < a->statesNum; i++)
-		printf("%s ", a->statesNames[i]);
-	printf("\n");
+	printf("Transition table: -------------\n");
+	
+	for (i = 0; i < a->statesNum; i++)
+		for (j = 0; j < a->transitionsNum; j++) {
+			int toIndex = a->transitionTable[(size_t) i * a->transitionsNum + j];
+			
+			if (toIndex == -1)
+				printf("%6s %c ??????\n", StateName(a, i), a->transitions[j]);
+			else
+				printf("%6s %c %-6s\n", StateName(a, i), a->transitions[j], StateName(a, toIndex));
+		}
+}
+
+// This function returns pointer to the first byte from 'str' to 'end' that is not a symbol,
+// or 'end' if all of them are symbols
+const unsigned char * SkipSymbolsScalar(const CompiledAutomaton * c, const unsigned char * str, const unsigned char * end) {
+	while (str < end && c->symbolValid[*str])
+		str++;
+	return str;
+}
+
+#ifdef HAVE_X86_SIMD
+// Vectorized SkipSymbolsScalar for 16 bytes at a time.
+// Low nibble of every byte selects a row of symbol matrix with one shuffle per half,
+// high nibble selects the half and a bit in the row with another shuffle
+__attribute__((target("ssse3")))
+const unsigned char * SkipSymbolsSsse3(const CompiledAutomaton * c, const unsigned char * str, const unsigned char * end) {
+	const __m128i bitsLow = _mm_loadu_si128((const __m128i *) c->symbolBitsLow);
+	const __m128i bitsHigh = _mm_loadu_si128((const __m128i *) c->symbolBitsHigh);
+	const __m128i bitOfNibble = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char) 128, 1, 2, 4, 8, 16, 32, 64, (char) 128);
+	const __m128i nibbleMask = _mm_set1_epi8(0x0f);
+	const __m128i seven = _mm_set1_epi8(7);
+	
+	while (end - str >= 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *) str);
+		__m128i low = _mm_and_si128(bytes, nibbleMask);
+		__m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibbleMask);
+		
+		__m128i upperHalf = _mm_cmpgt_epi8(high, seven);
+		__m128i row = _mm_or_si128(_mm_and_si128(upperHalf, _mm_shuffle_epi8(bitsHigh, low)),
+			_mm_andnot_si128(upperHalf, _mm_shuffle_epi8(bitsLow, low)));
+		__m128i bit = _mm_shuffle_epi8(bitOfNibble, high);
+		
+		__m128i missing = _mm_cmpeq_epi8(_mm_and_si128(row, bit), _mm_setzero_si128());
+		int mask = _mm_movemask_epi8(missing);
+		if (mask != 0)
+			return str + __builtin_ctz(mask);
+		str += 16;
+	}
+	
+	return SkipSymbolsScalar(c, str, end);
+}
+
+// The same check for 32 bytes at a time
+__attribute__((target("avx2")))
+const unsigned char * SkipSymbolsAvx2(const CompiledAutomaton * c, const unsigned char * str, const unsigned char * end) {
+	const __m256i bitsLow = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) c->symbolBitsLow));
+	const __m256i bitsHigh = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) c->symbolBitsHigh));
+	const __m256i bitOfNibble = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char) 128, 1, 2, 4, 8, 16, 32, 64, (char) 128,
+		1, 2, 4, 8, 16, 32, 64, (char) 128, 1, 2, 4, 8, 16, 32, 64, (char) 128);
+	const __m256i nibbleMask = _mm256_set1_epi8(0x0f);
+	const __m256i seven = _mm256_set1_epi8(7);
+	
+	while (end - str >= 32) {
+		__m256i bytes = _mm256_loadu_si256((const __m256i *) str);
+		__m256i low = _mm256_and_si256(bytes, nibbleMask);
+		__m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibbleMask);
+		
+		__m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(bitsLow, low), _mm256_shuffle_epi8(bitsHigh, low),
+			_mm256_cmpgt_epi8(high, seven));
+		__m256i bit = _mm256_shuffle_epi8(bitOfNibble, high);
+		
+		__m256i missing = _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), _mm256_setzero_si256());
+		unsigned int mask = (unsigned int) _mm256_movemask_epi8(missing);
+		if (mask != 0)
+			return str + __builtin_ctz(mask);
+		str += 32;
+	}
+	
+	return SkipSymbolsScalar(c, str, end);
+}
+#endif
+
+#ifdef HAVE_X86_SIMD
+// This function finds for every state of small automaton the state it leads to over symbols
+// from 'str' to 'end': byte s of 'map' gets the state reached from state s.
+// Vector of current states selects bytes of permutation of every byte class, so all states
+// move at once with a single shuffle and there is no table load on the dependency chain
+__attribute__((target("ssse3")))
+void MapStatesSsse3(const CompiledAutomaton * c, const unsigned char * str, const unsigned char * end, uint8_t * map) {
+	const uint8_t * permutations = c->statePermutations;
+	const uint8_t * byteClass = c->byteClass;
+	__m128i states = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	
+	for (; str < end; str++)
+		states = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (permutations + byteClass[*str] * ENUM_STATES)), states);
+	_mm_storeu_si128((__m128i *) map, states);
+}
+
+// This function runs small automaton over a record from its start state with a shuffle per byte,
+// so the dependency chain has no table load. Every lane holds the same state. Returns the state
+// at 'end' or the first deciding state found after a block, 'str' is moved past that block
+__attribute__((target("ssse3")))
+size_t RunSmallSsse3(const CompiledAutomaton * c, const unsigned char ** str, const unsigned char * end) {
+	const uint8_t * permutations = c->statePermutations;
+	const uint8_t * byteClass = c->byteClass;
+	const unsigned char * pos = *str;
+	__m128i states = _mm_set1_epi8((char) c->startState);
+	size_t state = c->startState;
+	
+	while (pos < end) {
+		const unsigned char * blockEnd = end - pos > ENUM_BLOCK ? pos + ENUM_BLOCK : end;
+		for (; pos < blockEnd; pos++)
+			states = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (permutations + byteClass[*pos] * ENUM_STATES)), states);
+		
+		state = (uint8_t) _mm_cvtsi128_si32(states);
+		if (state >= (size_t) c->stopState)
+			break;
+	}
+	
+	*str = pos;
+	return state;
+}
+#endif
+
+// Variant of symbol check used by SkipSymbols
+const unsigned char * (* SkipSymbolsVariant)(const CompiledAutomaton *, const unsigned char *, const unsigned char *) = SkipSymbolsScalar;
+
+// Variant of state mapping of small automata, NULL if this CPU has none
+void (* MapStatesVariant)(const CompiledAutomaton *, const unsigned char *, const unsigned char *, uint8_t *) = NULL;
+
+// Variant of shuffle run of records of small automata, NULL if this CPU has none
+size_t (* RunSmallVariant)(const CompiledAutomaton *, const unsigned char **, const unsigned char *) = NULL;
+
+// This function chooses the fastest variants of vectorized code this CPU supports
+// It must be called before any threads are started
+void SelectVectorCode(void) {
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		SkipSymbolsVariant = SkipSymbolsAvx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		SkipSymbolsVariant = SkipSymbolsSsse3;
+	
+	if (__builtin_cpu_supports("ssse3")) {
+		MapStatesVariant = MapStatesSsse3;
+		RunSmallVariant = RunSmallSsse3;
+	}
+#endif
+}
+
+// This function returns pointer to the first byte from 'str' to 'end' that is not a symbol,
+// or 'end' if all of them are symbols
+const unsigned char * SkipSymbols(const CompiledAutomaton * c, const unsigned char * str, const unsigned char * end) {
+	return SkipSymbolsVariant(c, str, end);
+}
+
+// This function gives result of a record once simulation got into one of states that decide it
+// 'str' points to the rest of record after the symbol that led to 'state'
+int DecideRecord(const CompiledAutomaton * c, size_t state, const unsigned char * str, const unsigned char * end) {
+	if (state == (size_t) c->wrongSymbolState || SkipSymbols(c, str, end) != end)
+		return 2;
+	
+	return IsFinishState(c, state) ? 0 : 1;
+}
+
+// This function tells if records of automaton are run with shuffles by ProcessSmallRecord
+int UsesSmallRecords(const CompiledAutomaton * c) {
+	return c->statePermutations != NULL && RunSmallVariant != NULL;
+}
+
+// Process record of small automaton from 'str' to 'end' with shuffles
+// Returns the same results as ProcessString
+int ProcessSmallRecord(const CompiledAutomaton * c, const unsigned char * str, const unsigned char * end) {
+	size_t state = RunSmallVariant(c, &str, end);
+	
+	if (state >= (size_t) c->stopState)
+		return DecideRecord(c, state, str, end);
+	return IsFinishState(c, state) ? 0 : 1;
+}
+
+// Simulation loop over NUL-terminated string, defined once for every table entry type.
+// Symbol check, simulation and search for string end are done in one pass:
+// unknown symbols lead to wrong symbol state, missing transitions lead to dead state.
+// Once dead state or absorbing finishing state is entered the result is known, unless
+// there is a wrong symbol in the rest of string, so only symbols are checked from there on
+#define DEFINE_RUN_STRING(NAME, TYPE) \
+int NAME(const CompiledAutomaton * c, const unsigned char * str) { \
+	const TYPE * table = (const TYPE *) c->table; \
+	const uint8_t * byteClass = c->byteClass; \
+	int rowShift = c->rowShift; \
+	size_t currentState = c->startState; \
+	size_t stopState = c->stopState; \
+	unsigned char symbol; \
+	\
+	while ((symbol = *str++) != '\0') { \
+		currentState = table[(currentState << rowShift) + byteClass[symbol]]; \
+		\
+		/* States that decide result are the last ones */ \
+		if (currentState >= stopState) { \
+			/* Nothing can change result after first wrong symbol */ \
+			if (currentState == (size_t) c->wrongSymbolState) \
+				return 2; \
+			\
+			const unsigned char * end = str + strlen((const char *) str); \
+			if (SkipSymbols(c, str, end) != end) \
+				return 2; \
+			break; \
+		} \
+	} \
+	\
+	return IsFinishState(c, currentState) ? 0 : 1; \
+}
+
+DEFINE_RUN_STRING(RunString8, uint8_t)
+DEFINE_RUN_STRING(RunString16, uint16_t)
+DEFINE_RUN_STRING(RunString32, uint32_t)
+
+// Process string using automaton. Possible results:
+// 0 - ACCEPTED
+// 1 - REJECTED
+// 2 - Found wrong symbol
+int ProcessString(const CompiledAutomaton * c, const char * string) {
+	const unsigned char * str = (const unsigned char *) string;
+	
+	if (c->matchRecord != NULL)
+		return c->matchRecord(str, str + strlen(string));
+	if (UsesSmallRecords(c))
+		return ProcessSmallRecord(c, str, str + strlen(string));
+	
+	switch (c->stateWidth) {
+		case 1:
+		return RunString8(c, str);
+		
+		case 2:
+		return RunString16(c, str);
+		
+		default:
+		return RunString32(c, str);
+	}
+}
+
+// Simulation loop over one newline-terminated record, defined once for every table entry type.
+// Newline is never a symbol (symbols are read as words), so it leads to wrong symbol state
+// and record end is found by the same check that catches wrong symbols.
+// After dead state or absorbing finishing state is entered only symbols of the rest
+// of record are checked.
+// On return 'cursor' points to newline that ends the record or to buffer end
+#define DEFINE_RUN_RECORD(NAME, TYPE) \
+int NAME(const CompiledAutomaton * c, const unsigned char ** cursor, const unsigned char * end) { \
+	const TYPE * table = (const TYPE *) c->table; \
+	const unsigned char * str = *cursor; \
+	const uint8_t * byteClass = c->byteClass; \
+	int rowShift = c->rowShift; \
+	size_t currentState = c->startState; \
+	size_t stopState = c->stopState; \
+	\
+	while (str < end) { \
+		size_t nextState = table[(currentState << rowShift) + byteClass[*str]]; \
+		\
+		/* States that decide result are the last ones */ \
+		if (nextState >= stopState) { \
+			if (nextState != (size_t) c->wrongSymbolState) { \
+				currentState = nextState; \
+				str = SkipSymbols(c, str + 1, end); \
+			} \
+			break; \
+		} \
+		\
+		currentState = nextState; \
+		str++; \
+	} \
+	\
+	if (str == end || *str == '\n') { \
+		*cursor = str; \
+		return IsFinishState(c, currentState) ? 0 : 1; \
+	} \
+	\
+	/* Wrong symbol inside the record, skip the rest of it */ \
+	str = (const unsigned char *) memchr(str, '\n', end - str); \
+	*cursor = str != NULL ? str : end; \
+	return 2; \
+}
+
+DEFINE_RUN_RECORD(RunRecord8, uint8_t)
+DEFINE_RUN_RECORD(RunRecord16, uint16_t)
+DEFINE_RUN_RECORD(RunRecord32, uint32_t)
+
+// Process record that starts at 'cursor' and ends with newline or at 'end'
+// Returns the same results as ProcessString and moves 'cursor' to the end of record
+int ProcessRecord(const CompiledAutomaton * c, const char ** cursor, const char * end) {
+	const unsigned char * str = (const unsigned char *) *cursor;
+	const unsigned char * strEnd = (const unsigned char *) end;
+	int res;
+	
+	if (c->matchRecord != NULL || UsesSmallRecords(c)) {
+		const char * newline = (const char *) memchr(*cursor, '\n', end - *cursor);
+		const char * recordEnd = newline != NULL ? newline : end;
+		if (c->matchRecord != NULL)
+			res = c->matchRecord(str, (const unsigned char *) recordEnd);
+		else
+			res = ProcessSmallRecord(c, str, (const unsigned char *) recordEnd);
+		*cursor = recordEnd;
+		return res;
+	}
+	
+	switch (c->stateWidth) {
+		case 1:
+		res = RunRecord8(c, &str, strEnd);
+		break;
+		
+		case 2:
+		res = RunRecord16(c, &str, strEnd);
+		break;
+		
+		default:
+		res = RunRecord32(c, &str, strEnd);
+		break;
+	}
+	
+	*cursor = (const char *) str;
+	return res;
+}
+
+// Simulation of a batch of records with known bounds, defined once for every table entry type.
+// Every step of a single record waits for the table load of the previous one, so BATCH_LANES
+// records are advanced in lockstep to let their loads overlap. Lane that finishes its record
+// takes the next one
+#define DEFINE_RUN_BATCH(NAME, TYPE) \
+void NAME(const CompiledAutomaton * c, const unsigned char * const * starts, const unsigned char * const * ends, \
+	int recordsNum, int * results) { \
+	const TYPE * table = (const TYPE *) c->table; \
+	const uint8_t * byteClass = c->byteClass; \
+	int rowShift = c->rowShift; \
+	size_t stopState = c->stopState; \
+	const unsigned char * pos[BATCH_LANES]; \
+	const unsigned char * end[BATCH_LANES]; \
+	size_t state[BATCH_LANES]; \
+	int record[BATCH_LANES]; \
+	int nextRecord = 0; \
+	int active = 0; \
+	int l; \
+	\
+	for (l = 0; l < BATCH_LANES; l++) \
+		record[l] = -1; \
+	\
+	for (;;) { \
+		/* Give free lanes new records */ \
+		for (l = 0; l < BATCH_LANES && nextRecord < recordsNum; l++) \
+			if (record[l] == -1) { \
+				record[l] = nextRecord; \
+				pos[l] = starts[nextRecord]; \
+				end[l] = ends[nextRecord]; \
+				state[l] = c->startState; \
+				nextRecord++; \
+				active++; \
+			} \
+		\
+		if (active == 0) \
+			break; \
+		\
+		/* Advance every lane by one symbol until one of them is done */ \
+		int finished = 0; \
+		while (!finished) \
+			for (l = 0; l < BATCH_LANES; l++) { \
+				if (record[l] == -1) \
+					continue; \
+				\
+				if (pos[l] == end[l]) { \
+					results[record[l]] = IsFinishState(c, state[l]) ? 0 : 1; \
+					record[l] = -1; \
+					active--; \
+					finished = 1; \
+					continue; \
+				} \
+				\
+				size_t nextState = table[(state[l] << rowShift) + byteClass[*pos[l]]]; \
+				if (nextState >= stopState) { \
+					results[record[l]] = DecideRecord(c, nextState, pos[l] + 1, end[l]); \
+					record[l] = -1; \
+					active--; \
+					finished = 1; \
+					continue; \
+				} \
+				\
+				state[l] = nextState; \
+				pos[l]++; \
+			} \
+	} \
+}
+
+DEFINE_RUN_BATCH(RunBatch8, uint8_t)
+DEFINE_RUN_BATCH(RunBatch16, uint16_t)
+DEFINE_RUN_BATCH(RunBatch32, uint32_t)
+
+// Process a batch of records given by their bounds, newlines are not part of records
+// Results are the same as of ProcessString
+void ProcessRecordBatch(const CompiledAutomaton * c, const char * const * starts, const char * const * ends,
+	int recordsNum, int * results) {
+	const unsigned char * const * str = (const unsigned char * const *) starts;
+	const unsigned char * const * strEnd = (const unsigned char * const *) ends;
+	
+	// Generated code keeps state in the instruction pointer, records go one by one
+	if (c->matchRecord != NULL) {
+		int i;
+		for (i = 0; i < recordsNum; i++)
+			results[i] = c->matchRecord(str[i], strEnd[i]);
+		return;
+	}
+	
+	// Small automata have no table load on the dependency chain to hide, records go one by one
+	if (UsesSmallRecords(c)) {
+		int i;
+		for (i = 0; i < recordsNum; i++)
+			results[i] = ProcessSmallRecord(c, str[i], strEnd[i]);
+		return;
+	}
+	
+	switch (c->stateWidth) {
+		case 1:
+		RunBatch8(c, str, strEnd, recordsNum, results);
+		break;
+		
+		case 2:
+		RunBatch16(c, str, strEnd, recordsNum, results);
+		break;
+		
+		default:
+		RunBatch32(c, str, strEnd, recordsNum, results);
+		break;
+	}
+}
+
+// Advancing of several states over the same symbols, defined once for every table entry type.
+// States do not depend on each other, so their table loads overlap
+#define DEFINE_ADVANCE_STATES(NAME, TYPE) \
+void NAME(const CompiledAutomaton * c, uint32_t * states, int statesNum, const unsigned char * str, \
+	const unsigned char * end) { \
+	const TYPE * table = (const TYPE *) c->table; \
+	const uint8_t * byteClass = c->byteClass; \
+	int rowShift = c->rowShift; \
+	int i; \
+	\
+	for (; str < end; str++) { \
+		size_t column = byteClass[*str]; \
+		for (i = 0; i < statesNum; i++) \
+			states[i] = table[((size_t) states[i] << rowShift) + column]; \
+	} \
+}
+
+DEFINE_ADVANCE_STATES(AdvanceStates8, uint8_t)
+DEFINE_ADVANCE_STATES(AdvanceStates16, uint16_t)
+DEFINE_ADVANCE_STATES(AdvanceStates32, uint32_t)
+
+// This function moves every of 'statesNum' states through symbols from 'str' to 'end'
+void AdvanceStates(const CompiledAutomaton * c, uint32_t * states, int statesNum, const unsigned char * str,
+	const unsigned char * end) {
+	switch (c->stateWidth) {
+		case 1:
+		AdvanceStates8(c, states, statesNum, str, end);
+		break;
+		
+		case 2:
+		AdvanceStates16(c, states, statesNum, str, end);
+		break;
+		
+		default:
+		AdvanceStates32(c, states, statesNum, str, end);
+		break;
+	}
+}
+
+#ifdef HAVE_THREADS
+// Part of a huge record simulated by one thread
+typedef struct {
+	const CompiledAutomaton * automaton;
+	const unsigned char * start;
+	const unsigned char * end;
+	
+	// Set for the first part, it is simulated from the start state only
+	int first;
+	
+	// Speculation is given up when more distinct states than this are still followed
+	int statesLimit;
+	
+	// For every state before stopState the state it leads to at the end of part,
+	// the first part has only one entry for the start state
+	uint32_t * map;
+	
+	// Set when the part holds only symbols
+	int valid;
+	
+	// Set when the part could not be mapped
+	int failed;
+} SpeculativePart;
+
+// Worker maps states at the start of its part to states at the end of it. States are followed
+// from all of them at once and the ones that met are merged after every block, so work depends
+// on the number of distinct states rather than on the number of states
+void * SpeculativeWorker(void * arg) {
+	SpeculativePart * part = (SpeculativePart *) arg;
+	const CompiledAutomaton * c = part->automaton;
+	int mapSize = part->first ? 1 : (int) c->stopState;
+	int i;
+	
+	// Wrong symbol decides the whole record whatever states lead to it
+	part->valid = SkipSymbols(c, part->start, part->end) == part->end;
+	if (!part->valid)
+		return NULL;
+	
+	// Small automata are mapped from every state with shuffles
+	if (c->statePermutations != NULL && MapStatesVariant != NULL) {
+		uint8_t map[ENUM_STATES];
+		MapStatesVariant(c, part->start, part->end, map);
+		for (i = 0; i < mapSize; i++)
+			part->map[i] = map[part->first ? c->startState : i];
+		return NULL;
+	}
+	
+	// Followed states, index of followed state for every mapped state and merging space
+	uint32_t * states = (uint32_t *) malloc((mapSize + 1) * sizeof(uint32_t));
+	int * origin = (int *) malloc((mapSize + 1) * sizeof(int));
+	int * merged = (int *) malloc((mapSize + 1) * sizeof(int));
+	int * stateSlot = (int *) malloc(c->statesNum * sizeof(int));
+	if (states == NULL || origin == NULL || merged == NULL || stateSlot == NULL) {
+		part->failed = 1;
+		goto done;
+	}
+	
+	for (i = 0; i < mapSize; i++) {
+		states[i] = part->first ? (uint32_t) c->startState : (uint32_t) i;
+		origin[i] = i;
+	}
+	for (i = 0; i < c->statesNum; i++)
+		stateSlot[i] = -1;
+	
+	// Blocks are short at first, while there are many states to follow
+	int statesNum = mapSize;
+	size_t blockSize = SPECULATION_FIRST_BLOCK;
+	const unsigned char * str = part->start;
+	while (str < part->end) {
+		const unsigned char * blockEnd = (size_t) (part->end - str) > blockSize ? str + blockSize : part->end;
+		AdvanceStates(c, states, statesNum, str, blockEnd);
+		str = blockEnd;
+		if (blockSize < SPECULATION_BLOCK)
+			blockSize *= 2;
+		
+		// Keep one copy of every state that is still followed
+		int distinctNum = 0;
+		for (i = 0; i < statesNum; i++) {
+			uint32_t state = states[i];
+			if (stateSlot[state] == -1) {
+				stateSlot[state] = distinctNum;
+				states[distinctNum++] = state;
+			}
+			merged[i] = stateSlot[state];
+		}
+		for (i = 0; i < distinctNum; i++)
+			stateSlot[states[i]] = -1;
+		
+		if (distinctNum < statesNum)
+			for (i = 0; i < mapSize; i++)
+				origin[i] = merged[origin[i]];
+		statesNum = distinctNum;
+		
+		// States that do not merge make every part as slow as the whole record
+		if (statesNum > part->statesLimit) {
+			part->failed = 1;
+			goto done;
+		}
+	}
+	
+	for (i = 0; i < mapSize; i++)
+		part->map[i] = states[origin[i]];
+	
+done:
+	free(states);
+	free(origin);
+	free(merged);
+	free(stateSlot);
+	return NULL;
+}
+#endif
+
+// This function simulates a single huge record on 'threadsNum' threads. Record is split into
+// parts and every thread finds which state each state leads to over its part. Maps are then
+// applied one after another starting from the start state. Parts whose states do not merge
+// make the record fall back to simulation on one thread
+// Results are the same as of ProcessString, newline is not part of record
+int ProcessHugeRecord(const CompiledAutomaton * c, const char * start, const char * end, int threadsNum) {
+	int res = -1;
+	
+#ifdef HAVE_THREADS
+	SpeculativePart * parts = (SpeculativePart *) calloc(threadsNum, sizeof(SpeculativePart));
+	pthread_t * workers = (pthread_t *) malloc(threadsNum * sizeof(pthread_t));
+	char * started = (char *) calloc(threadsNum, 1);
+	size_t partSize = (end - start) / threadsNum;
+	int i;
+	
+	if (parts == NULL || workers == NULL || started == NULL)
+		goto done;
+	
+	for (i = 0; i < threadsNum; i++) {
+		parts[i].automaton = c;
+		parts[i].start = (const unsigned char *) start + i * partSize;
+		parts[i].end = i == threadsNum - 1 ? (const unsigned char *) end : parts[i].start + partSize;
+		parts[i].first = i == 0;
+		parts[i].statesLimit = threadsNum;
+		parts[i].map = (uint32_t *) malloc((i == 0 ? 1 : c->stopState + 1) * sizeof(uint32_t));
+		if (parts[i].map == NULL)
+			parts[i].failed = 1;
+	}
+	
+	// This thread takes the first part, parts without a thread are done here too
+	for (i = 1; i < threadsNum; i++)
+		if (!parts[i].failed)
+			started[i] = pthread_create(&workers[i], NULL, SpeculativeWorker, &parts[i]) == 0;
+	if (!parts[0].failed)
+		SpeculativeWorker(&parts[0]);
+	for (i = 1; i < threadsNum; i++) {
+		if (started[i])
+			pthread_join(workers[i], NULL);
+		else if (!parts[i].failed)
+			SpeculativeWorker(&parts[i]);
+	}
+	
+	int failed = 0;
+	for (i = 0; i < threadsNum; i++) {
+		if (!parts[i].valid && !parts[i].failed) {
+			res = 2;
+			goto done;
+		}
+		failed |= parts[i].failed;
+	}
+	if (failed)
+		goto done;
+	
+	// Deciding states stay the same on symbols, maps are not needed once one is reached
+	size_t state = parts[0].map[0];
+	for (i = 1; i < threadsNum && state < (size_t) c->stopState; i++)
+		state = parts[i].map[state];
+	res = IsFinishState(c, state) ? 0 : 1;
+	
+done:
+	if (parts != NULL)
+		for (i = 0; i < threadsNum; i++)
+			free(parts[i].map);
+	free(parts);
+	free(workers);
+	free(started);
+#else
+	(void) threadsNum;
+#endif
+	
+	if (res == -1)
+		ProcessRecordBatch(c, &start, &end, 1, &res);
+	return res;
+}
+
+// This function finds cached state with a key or adds it
+// Returns index of the state, -1 if cache is full
+int LazyState(LazyCache * z, const uint32_t * key, int keyLength) {
+	size_t keySize = keyLength * sizeof(uint32_t);
+	size_t slot = (size_t) (HashKey(key, keyLength) % (LAZY_MAX_STATES * 2));
+	int i;
+	
+	while (z->hash[slot] != -1) {
+		int state = z->hash[slot];
+		if (z->keyLengths[state] == keyLength && memcmp(z->keys.data + z->keyOffsets[state], key, keySize) == 0)
+			return state;
+		slot = (slot + 1) % (LAZY_MAX_STATES * 2);
+	}
+	
+	if (z->statesNum == LAZY_MAX_STATES || BufferReserve(&z->keys, keySize + 1))
+		return -1;
+	
+	int state = z->statesNum++;
+	z->hash[slot] = state;
+	z->keyOffsets[state] = z->keys.length;
+	z->keyLengths[state] = keyLength;
+	BufferAppend(&z->keys, (const char *) key, keySize);
+	
+	for (i = 0; i < z->classesNum; i++)
+		z->table[(size_t) state * z->classesNum + i] = -1;
+	memset(z->accepted + (size_t) state * z->acceptWords, 0, z->acceptWords * sizeof(uint64_t));
+	z->accepting(z->engine, key, keyLength, z->accepted + (size_t) state * z->acceptWords);
+	return state;
+}
+
+// This function empties the cache, only sink and start states are added back.
+// Cache that did not run enough bytes since it was emptied last time is marked as thrashing,
+// so is cache whose states cannot be added back. Start state is then -1
+void LazyFlush(LazyCache * z) {
+	int i;
+	
+	if (z->statesNum > 0 && z->bytesSinceFlush < (size_t) LAZY_MAX_STATES * LAZY_MIN_BYTES_PER_STATE)
+		z->thrashing = 1;
+	z->bytesSinceFlush = 0;
+	
+	z->statesNum = 0;
+	z->keys.length = 0;
+	for (i = 0; i < LAZY_MAX_STATES * 2; i++)
+		z->hash[i] = -1;
+	
+	// Sink has to be state 0
+	z->startState = -1;
+	if (LazyState(z, z->sinkKey, z->sinkKeyLength) == 0)
+		z->startState = LazyState(z, z->startKey, z->startKeyLength);
+	if (z->startState == -1)
+		z->thrashing = 1;
+}
+
+// This function finds state that cached state goes to on bytes of a class, the cache is
+// emptied when the state does not fit. Cache whose states cannot be added even when it is
+// empty is marked as thrashing
+// Returns index of the next state, -1 if memory ran out
+int LazyNext(LazyCache * z, int state, int byteClass) {
+	int keyLength = z->keyLengths[state];
+	memcpy(z->currentKey, z->keys.data + z->keyOffsets[state], keyLength * sizeof(uint32_t));
+	
+	int nextLength = z->next(z->engine, z->scratch, z->currentKey, keyLength, byteClass, z->nextKey);
+	int next = LazyState(z, z->nextKey, nextLength);
+	if (next == -1) {
+		LazyFlush(z);
+		state = LazyState(z, z->currentKey, keyLength);
+		next = state != -1 ? LazyState(z, z->nextKey, nextLength) : -1;
+		if (next == -1) {
+			z->thrashing = 1;
+			return -1;
+		}
+	}
+	
+	z->table[(size_t) state * z->classesNum + byteClass] = next;
+	return next;
+}
+
+// This function runs record from 'str' to 'end' over cached states, building the missing ones
+// Returns the state record ends in, -1 if memory ran out
+int LazyRun(LazyCache * z, const unsigned char * str, const unsigned char * end) {
+	const unsigned char * counted = str;
+	int state = z->startState;
+	
+	while (str < end && state > 0) {
+		int byteClass = z->byteClass[*str++];
+		int next = z->table[(size_t) state * z->classesNum + byteClass];
+		
+		if (next == -1) {
+			// Bytes are counted only when cache may be emptied
+			z->bytesSinceFlush += str - counted;
+			counted = str;
+			next = LazyNext(z, state, byteClass);
+			if (next == -1)
+				return -1;
+		}
+		state = next;
+	}
+	
+	z->bytesSinceFlush += str - counted;
+	return state;
+}
+
+// This function runs record from 'str' to 'end' over keys of states without caching them,
+// for caches that thrash. Running stops at the sink state
+// Returns length of the key record ends in, the key is left in currentKey
+int LazyRunKeys(LazyCache * z, const unsigned char * str, const unsigned char * end) {
+	int keyLength = z->startKeyLength;
+	size_t sinkSize = z->sinkKeyLength * sizeof(uint32_t);
+	
+	memcpy(z->currentKey, z->startKey, keyLength * sizeof(uint32_t));
+	while (str < end && !(keyLength == z->sinkKeyLength && memcmp(z->currentKey, z->sinkKey, sinkSize) == 0)) {
+		keyLength = z->next(z->engine, z->scratch, z->currentKey, keyLength, z->byteClass[*str++], z->nextKey);
+		
+		uint32_t * key = z->currentKey;
+		z->currentKey = z->nextKey;
+		z->nextKey = key;
+	}
+	
+	return keyLength;
+}
+
+// This function releases a cache
+void FreeLazyCache(LazyCache * z) {
+	if (z == NULL)
+		return;
+	
+	free(z->startKey);
+	free(z->sinkKey);
+	free(z->table);
+	free(z->accepted);
+	free(z->keys.data);
+	free(z->keyOffsets);
+	free(z->keyLengths);
+	free(z->hash);
+	free(z->currentKey);
+	free(z->nextKey);
+	free(z->scratch);
+	free(z);
+}
+
+// This function creates empty cache with parameters of 'model'
+// Returns the cache, NULL if memory ran out
+LazyCache * NewLazyCache(const LazyCache * model) {
+	LazyCache * z = (LazyCache *) calloc(1, sizeof(LazyCache));
+	if (z == NULL)
+		return NULL;
+	
+	*z = *model;
+	z->keys.data = NULL;
+	z->keys.length = 0;
+	z->keys.capacity = 0;
+	z->startKey = (uint32_t *) malloc((model->startKeyLength + 1) * sizeof(uint32_t));
+	z->sinkKey = (uint32_t *) malloc((model->sinkKeyLength + 1) * sizeof(uint32_t));
+	z->table = (int32_t *) malloc((size_t) LAZY_MAX_STATES * model->classesNum * sizeof(int32_t));
+	z->accepted = (uint64_t *) malloc((size_t) LAZY_MAX_STATES * model->acceptWords * sizeof(uint64_t));
+	z->keyOffsets = (size_t *) malloc(LAZY_MAX_STATES * sizeof(size_t));
+	z->keyLengths = (int *) malloc(LAZY_MAX_STATES * sizeof(int));
+	z->hash = (int *) malloc(LAZY_MAX_STATES * 2 * sizeof(int));
+	z->currentKey = (uint32_t *) malloc((model->maxKeyLength + 1) * sizeof(uint32_t));
+	z->nextKey = (uint32_t *) malloc((model->maxKeyLength + 1) * sizeof(uint32_t));
+	z->scratch = calloc(model->scratchSize + 1, 1);
+	
+	if (z->startKey == NULL || z->sinkKey == NULL || z->table == NULL || z->accepted == NULL
+		|| z->keyOffsets == NULL || z->keyLengths == NULL || z->hash == NULL
+		|| z->currentKey == NULL || z->nextKey == NULL || z->scratch == NULL) {
+		FreeLazyCache(z);
+		return NULL;
+	}
+	
+	memcpy(z->startKey, model->startKey, model->startKeyLength * sizeof(uint32_t));
+	memcpy(z->sinkKey, model->sinkKey, model->sinkKeyLength * sizeof(uint32_t));
+	z->statesNum = 0;
+	LazyFlush(z);
+	if (z->startState == -1) {
+		FreeLazyCache(z);
+		return NULL;
+	}
+	z->thrashing = 0;
+	return z;
+}
+
+// This function creates pool of caches that are made like 'model', keys of the model are copied
+// Returns the pool, NULL if memory ran out
+LazyPool * NewLazyPool(const LazyCache * model) {
+	LazyPool * pool = (LazyPool *) calloc(1, sizeof(LazyPool));
+	if (pool == NULL)
+		return NULL;
+	
+	pool->model = *model;
+	pool->model.startKey = (uint32_t *) malloc((model->startKeyLength + 1) * sizeof(uint32_t));
+	pool->model.sinkKey = (uint32_t *) malloc((model->sinkKeyLength + 1) * sizeof(uint32_t));
+	if (pool->model.startKey == NULL || pool->model.sinkKey == NULL) {
+		free(pool->model.startKey);
+		free(pool->model.sinkKey);
+		free(pool);
+		return NULL;
+	}
+	memcpy(pool->model.startKey, model->startKey, model->startKeyLength * sizeof(uint32_t));
+	memcpy(pool->model.sinkKey, model->sinkKey, model->sinkKeyLength * sizeof(uint32_t));
+	
+#ifdef HAVE_THREADS
+	pthread_mutex_init(&pool->lock, NULL);
+#endif
+	return pool;
+}
+
+// This function releases pool and every cache in it
+void FreeLazyPool(LazyPool * pool) {
+	int i;
+	
+	if (pool == NULL)
+		return;
+	
+	for (i = 0; i < pool->cachesNum; i++)
+		FreeLazyCache(pool->caches[i]);
+	free(pool->caches);
+	free(pool->taken);
+	free(pool->model.startKey);
+	free(pool->model.sinkKey);
+#ifdef HAVE_THREADS
+	pthread_mutex_destroy(&pool->lock);
+#endif
+	free(pool);
+}
+
+// This function takes a cache no one uses, a new one is made if every cache is taken
+// Returns the cache, NULL if memory ran out
+LazyCache * TakeLazyCache(LazyPool * pool) {
+	LazyCache * z = NULL;
+	int i;
+	
+#ifdef HAVE_THREADS
+	pthread_mutex_lock(&pool->lock);
+#endif
+	for (i = 0; i < pool->cachesNum && z == NULL; i++)
+		if (!pool->taken[i]) {
+			pool->taken[i] = 1;
+			z = pool->caches[i];
+		}
+	
+	if (z == NULL) {
+		LazyCache ** newCaches = (LazyCache **) realloc(pool->caches, (pool->cachesNum + 1) * sizeof(LazyCache *));
+		if (newCaches != NULL)
+			pool->caches = newCaches;
+		char * newTaken = (char *) realloc(pool->taken, pool->cachesNum + 1);
+		if (newTaken != NULL)
+			pool->taken = newTaken;
+		
+		if (newCaches != NULL && newTaken != NULL && (z = NewLazyCache(&pool->model)) != NULL) {
+			pool->caches[pool->cachesNum] = z;
+			pool->taken[pool->cachesNum] = 1;
+			pool->cachesNum++;
+		}
+	}
+#ifdef HAVE_THREADS
+	pthread_mutex_unlock(&pool->lock);
+#endif
+	
+	return z;
+}
+
+// This function gives taken cache back to the pool
+void ReturnLazyCache(LazyPool * pool, LazyCache * z) {
+	int i;
+	
+#ifdef HAVE_THREADS
+	pthread_mutex_lock(&pool->lock);
+#endif
+	for (i = 0; i < pool->cachesNum; i++)
+		if (pool->caches[i] == z)
+			pool->taken[i] = 0;
+#ifdef HAVE_THREADS
+	pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+// This function splits bytes into classes of product of automata of a set:
+// bytes share a class if every automaton puts them in the same class
+void BuildProductClasses(AutomatonSet * set) {
+	int b, j, k;
+	
+	set->productClassesNum = 0;
+	for (b = 0; b < 256; b++) {
+		for (j = 0; j < set->productClassesNum; j++) {
+			for (k = 0; k < set->automataNum; k++)
+				if (set->automata[k].byteClass[b] != set->automata[k].byteClass[set->productClassByte[j]])
+					break;
+			if (k == set->automataNum)
+				break;
+		}
+		
+		if (j == set->productClassesNum)
+			set->productClassByte[set->productClassesNum++] = (uint8_t) b;
+		set->productClass[b] = (uint8_t) j;
+	}
+}
+
+// This function finds tuple of states that automata of a set go to from 'tuple' on bytes of
+// product class 'productClass'. Tuple where every automaton is in dead or wrong symbol state
+// cannot accept anymore, every such tuple is replaced with the one of wrong symbol states
+// Returns 1 if the next tuple is hopeless, 0 otherwise
+int ProductNext(const AutomatonSet * set, const uint32_t * tuple, int productClass, uint32_t * next) {
+	unsigned char symbol = set->productClassByte[productClass];
+	int hopeless = 1;
+	int k;
+	
+	for (k = 0; k < set->automataNum; k++) {
+		const CompiledAutomaton * c = &set->automata[k];
+		next[k] = CompiledNext(c, tuple[k], symbol);
+		if (next[k] < (uint32_t) c->deadState)
+			hopeless = 0;
+	}
+	
+	if (hopeless)
+		for (k = 0; k < set->automataNum; k++)
+			next[k] = set->automata[k].wrongSymbolState;
+	return hopeless;
+}
+
+// This function finds product state of a tuple of states, the tuple is added if it is new.
+// 'tuples' holds statesNum tuples of automataNum states, 'hash' is open addressing table
+// of PRODUCT_MAX_STATES * 2 state indexes
+// Returns index of product state, -1 if there are too many states or memory ran out
+int ProductState(AutomatonSet * set, ByteBuffer * tuples, int * hash, const uint32_t * tuple) {
+	size_t tupleSize = set->automataNum * sizeof(uint32_t);
+	uint64_t h = 14695981039346656037ull;
+	int k;
+	
+	for (k = 0; k < set->automataNum; k++)
+		h = (h ^ tuple[k]) * 1099511628211ull;
+	
+	size_t slot = (size_t) (h % (PRODUCT_MAX_STATES * 2));
+	while (hash[slot] != -1) {
+		if (memcmp(tuples->data + hash[slot] * tupleSize, tuple, tupleSize) == 0)
+			return hash[slot];
+		slot = (slot + 1) % (PRODUCT_MAX_STATES * 2);
+	}
+	
+	if (set->productStatesNum == PRODUCT_MAX_STATES || BufferAppend(tuples, (const char *) tuple, tupleSize))
+		return -1;
+	hash[slot] = set->productStatesNum;
+	return set->productStatesNum++;
+}
+
+// This function builds product of automata of a set by exploring tuples reachable from the start.
+// Hopeless tuples become one sink state
+// Returns 0 on success, 1 if the product is too large or memory ran out
+int BuildProduct(AutomatonSet * set) {
+	int n = set->automataNum;
+	int j, k;
+	
+	if (n > PRODUCT_MAX_AUTOMATA)
+		return 1;
+	
+	ByteBuffer tuples = { NULL, 0, 0 };
+	ByteBuffer table = { NULL, 0, 0 };
+	ByteBuffer accepted = { NULL, 0, 0 };
+	int * hash = (int *) malloc(PRODUCT_MAX_STATES * 2 * sizeof(int));
+	uint32_t * tuple = (uint32_t *) calloc(n, sizeof(uint32_t));
+	int res = 1;
+	int i;
+	
+	if (hash == NULL || tuple == NULL)
+		goto done;
+	for (i = 0; i < PRODUCT_MAX_STATES * 2; i++)
+		hash[i] = -1;
+	
+	set->productStatesNum = 0;
+	for (k = 0; k < n; k++)
+		tuple[k] = set->automata[k].wrongSymbolState;
+	set->productSink = ProductState(set, &tuples, hash, tuple);
+	for (k = 0; k < n; k++)
+		tuple[k] = set->automata[k].startState;
+	set->productStart = ProductState(set, &tuples, hash, tuple);
+	if (set->productSink == -1 || set->productStart == -1)
+		goto done;
+	
+	// States are explored in order they are found
+	for (i = 0; i < set->productStatesNum; i++) {
+		uint64_t acceptedBy = 0;
+		for (k = 0; k < n; k++)
+			if (IsFinishState(&set->automata[k], ((const uint32_t *) tuples.data)[(size_t) i * n + k]))
+				acceptedBy |= (uint64_t) 1 << k;
+		if (BufferAppend(&accepted, (const char *) &acceptedBy, sizeof(acceptedBy)))
+			goto done;
+		
+		for (j = 0; j < set->productClassesNum; j++) {
+			int hopeless = ProductNext(set, (const uint32_t *) tuples.data + (size_t) i * n, j, tuple);
+			uint32_t next = (uint32_t) (hopeless ? set->productSink : ProductState(set, &tuples, hash, tuple));
+			if (next == (uint32_t) -1 || BufferAppend(&table, (const char *) &next, sizeof(next)))
+				goto done;
+		}
+	}
+	
+	set->productTable = (uint32_t *) table.data;
+	set->productAccepted = (uint64_t *) accepted.data;
+	table.data = NULL;
+	accepted.data = NULL;
+	res = 0;
+	
+done:
+	if (res)
+		set->productStatesNum = 0;
+	free(tuples.data);
+	free(table.data);
+	free(accepted.data);
+	free(hash);
+	free(tuple);
+	return res;
+}
+
+// Lazy product engine: key of a product state is the tuple of states of all automata
+int ProductNextKey(const void * engine, void * scratch, const uint32_t * key, int keyLength, int byteClass, uint32_t * nextKey) {
+	(void) scratch;
+	ProductNext((const AutomatonSet *) engine, key, byteClass, nextKey);
+	return keyLength;
+}
+
+// Lazy product engine: accepting sets of a tuple are the automata in finishing states
+void ProductAccepting(const void * engine, const uint32_t * key, int keyLength, uint64_t * accepted) {
+	const AutomatonSet * set = (const AutomatonSet *) engine;
+	int k;
+	
+	for (k = 0; k < keyLength; k++)
+		if (IsFinishState(&set->automata[k], key[k]))
+			accepted[k / 64] |= (uint64_t) 1 << (k % 64);
+}
+
+// This function prepares caches of product states that are built as input reaches them
+// Returns 0 on success, 1 on failure
+int BuildLazyProduct(AutomatonSet * set) {
+	LazyCache model;
+	int n = set->automataNum;
+	int k;
+	
+	memset(&model, 0, sizeof(model));
+	model.next = ProductNextKey;
+	model.accepting = ProductAccepting;
+	model.engine = set;
+	memcpy(model.byteClass, set->productClass, 256);
+	model.classesNum = set->productClassesNum;
+	model.acceptWords = set->wordsNum;
+	model.maxKeyLength = n;
+	model.startKeyLength = n;
+	model.sinkKeyLength = n;
+	model.startKey = (uint32_t *) malloc(n * sizeof(uint32_t));
+	model.sinkKey = (uint32_t *) malloc(n * sizeof(uint32_t));
+	
+	if (model.startKey != NULL && model.sinkKey != NULL) {
+		for (k = 0; k < n; k++) {
+			model.startKey[k] = set->automata[k].startState;
+			model.sinkKey[k] = set->automata[k].wrongSymbolState;
+		}
+		set->lazyProduct = NewLazyPool(&model);
+	}
+	
+	free(model.startKey);
+	free(model.sinkKey);
+	return set->lazyProduct != NULL ? 0 : 1;
+}
+
+// This function classifies a batch of records by a set of automata. Bits of automata that accept
+// record i are set in 'accepted' words from i * wordsNum. Product automaton runs every record once,
+// built or lazily built one. Records that cache of lazy product thrashes on, and all records when
+// there is no product, are classified by every automaton running the batch while it stays in cache
+void ProcessSetBatch(const AutomatonSet * set, const char * const * starts, const char * const * ends,
+	int recordsNum, uint64_t * accepted) {
+	int i, k;
+	
+	memset(accepted, 0, (size_t) recordsNum * set->wordsNum * sizeof(uint64_t));
+	
+	if (set->lazyProduct != NULL) {
+		LazyCache * z = TakeLazyCache(set->lazyProduct);
+		
+		for (i = 0; z != NULL && !z->thrashing && i < recordsNum; i++) {
+			int state = LazyRun(z, (const unsigned char *) starts[i], (const unsigned char *) ends[i]);
+			if (state == -1)
+				break;
+			memcpy(accepted + (size_t) i * set->wordsNum, z->accepted + (size_t) state * z->acceptWords,
+				set->wordsNum * sizeof(uint64_t));
+		}
+		
+		if (z != NULL)
+			ReturnLazyCache(set->lazyProduct, z);
+		
+		// The rest of batch is run one automaton after another
+		starts += i;
+		ends += i;
+		accepted += (size_t) i * set->wordsNum;
+		recordsNum -= i;
+	}
+	
+	if (set->productTable != NULL) {
+		const uint32_t * table = set->productTable;
+		const uint8_t * productClass = set->productClass;
+		size_t classesNum = set->productClassesNum;
+		uint32_t sink = set->productSink;
+		
+		for (i = 0; i < recordsNum; i++) {
+			const unsigned char * str = (const unsigned char *) starts[i];
+			const unsigned char * end = (const unsigned char *) ends[i];
+			uint32_t state = set->productStart;
+			
+			while (str < end && state != sink)
+				state = table[state * classesNum + productClass[*str++]];
+			accepted[i] = set->productAccepted[state];
+		}
+		return;
+	}
+	
+	int results[BATCH_RECORDS];
+	for (k = 0; k < set->automataNum; k++) {
+		ProcessRecordBatch(&set->automata[k], starts, ends, recordsNum, results);
+		for (i = 0; i < recordsNum; i++)
+			if (results[i] == 0)
+				accepted[(size_t) i * set->wordsNum + k / 64] |= (uint64_t) 1 << (k % 64);
+	}
+}
+
+// This function prepares caches of sets of states of nondeterministic automaton, so that
+// only the sets input reaches become deterministic states. Bytes that are not symbols
+// are class 0 and lead to the empty set, which is the sink state
+// Returns pool of the caches, NULL if memory ran out
+LazyPool * BuildLazyNfa(const Nfa * n) {
+	const Automaton * a = &n->states;
+	LazyPool * pool = NULL;
+	LazyCache model;
+	int b;
+	
+	memset(&model, 0, sizeof(model));
+	model.next = NfaNextKey;
+	model.accepting = NfaAccepting;
+	model.engine = n;
+	for (b = 0; b < 256; b++)
+		model.byteClass[b] = (uint8_t) (n->byteSymbol[b] + 1);
+	model.classesNum = a->transitionsNum + 1;
+	model.acceptWords = 1;
+	model.maxKeyLength = a->statesNum;
+	model.sinkKeyLength = 0;
+	model.scratchSize = a->statesNum;
+	model.startKey = (uint32_t *) malloc(a->statesNum * sizeof(uint32_t));
+	model.sinkKey = (uint32_t *) malloc(sizeof(uint32_t));
+	uint8_t * marks = (uint8_t *) calloc(a->statesNum, sizeof(uint8_t));
+	
+	if (model.startKey != NULL && model.sinkKey != NULL && marks != NULL) {
+		model.startKeyLength = NfaStartKey(n, marks, model.startKey);
+		pool = NewLazyPool(&model);
+	}
+	
+	free(model.startKey);
+	free(model.sinkKey);
+	free(marks);
+	return pool;
+}
+
+// This function classifies a batch of records by automaton whose states are built lazily from
+// sets of states of nondeterministic automaton, results are the same as ProcessString gives.
+// Once the cache thrashes, records are run over sets of states without caching them
+// Returns 0 on success, 1 if memory ran out
+int ProcessLazyBatch(LazyPool * pool, const char * const * starts, const char * const * ends,
+	int recordsNum, int * results) {
+	LazyCache * z = TakeLazyCache(pool);
+	int i;
+	
+	if (z == NULL)
+		return 1;
+	
+	for (i = 0; i < recordsNum; i++) {
+		const unsigned char * str = (const unsigned char *) starts[i];
+		const unsigned char * end = (const unsigned char *) ends[i];
+		uint64_t accepting = 0;
+		int sink;
+		
+		if (!z->thrashing) {
+			int state = LazyRun(z, str, end);
+			if (state == -1) {
+				ReturnLazyCache(pool, z);
+				return 1;
+			}
+			sink = state == 0;
+			accepting = z->accepted[(size_t) state * z->acceptWords];
+		} else {
+			int keyLength = LazyRunKeys(z, str, end);
+			sink = keyLength == 0;
+			z->accepting(z->engine, z->currentKey, keyLength, &accepting);
+		}
+		
+		// Input that reached the sink may have bytes that are not symbols
+		if (sink) {
+			results[i] = 1;
+			while (str < end && results[i] == 1)
+				if (z->byteClass[*str++] == 0)
+					results[i] = 2;
+		} else {
+			results[i] = accepting ? 0 : 1;
+		}
+	}
+	
+	ReturnLazyCache(pool, z);
+	return 0;
+}
+
+// This function prepares empty result writer, 'automataNum' is 0 unless records are
+// classified by a set of automata
+// Returns 0 on success, 1 on failure
+int InitResults(ResultWriter * w, int mode, int automataNum) {
+	w->mode = mode;
+	w->buffer.data = NULL;
+	w->buffer.length = 0;
+	w->buffer.capacity = 0;
+	w->counts[0] = w->counts[1] = w->counts[2] = 0;
+	w->scan = 0;
+	w->automataNum = automataNum;
+	w->acceptedBy = NULL;
+	
+	if (automataNum > 0) {
+		w->acceptedBy = (long *) calloc(automataNum + 1, sizeof(long));
+		if (w->acceptedBy == NULL)
+			return 1;
+	}
+	return 0;
+}
+
+// This function appends result of processing for a string of given length to output buffer
+void AppendResult(ResultWriter * w, int res, const char * line, size_t length) {
+	static const char * prefixes[3] = { "ACCEPTED LINE ", "REJECTED LINE ", "WRONG SYMBOL: " };
+	
+	if (res < 0 || res > 2) {
+		BufferAppend(&w->buffer, "UNKNOWN ERROR ", 14);
+		BufferAppend(&w->buffer, line, length);
+		BufferAppend(&w->buffer, "\n", 1);
+		return;
+	}
+	
+	w->counts[res]++;
+	if (w->mode == OUTPUT_COUNTS || (w->mode == OUTPUT_ACCEPTED && res != 0))
+		return;
+	
+	// Prefix is skipped when only accepted lines are printed
+	size_t prefixLength = w->mode == OUTPUT_ALL ? 14 : 0;
+	if (BufferReserve(&w->buffer, prefixLength + length + 1))
+		return;
+	
+	char * dst = w->buffer.data + w->buffer.length;
+	memcpy(dst, prefixes[res], prefixLength);
+	memcpy(dst + prefixLength, line, length);
+	dst[prefixLength + length] = '\n';
+	w->buffer.length += prefixLength + length + 1;
+}
+
+// This function appends result of a set of automata for a string of given length to output buffer.
+// 'accepted' has a bit for every automaton that accepts the string
+void AppendSetResult(ResultWriter * w, const uint64_t * accepted, const char * line, size_t length) {
+	char number[16];
+	int i, any = 0;
+	
+	for (i = 0; i < w->automataNum; i++)
+		if ((accepted[i / 64] >> (i % 64)) & 1) {
+			w->acceptedBy[i]++;
+			any = 1;
+		}
+	if (!any)
+		w->acceptedBy[w->automataNum]++;
+	
+	if (w->mode == OUTPUT_COUNTS || (w->mode == OUTPUT_ACCEPTED && !any))
+		return;
+	
+	// Indexes of accepting automata are listed before the string
+	BufferAppend(&w->buffer, "ACCEPTED BY", 11);
+	for (i = 0; i < w->automataNum; i++)
+		if ((accepted[i / 64] >> (i % 64)) & 1)
+			BufferAppend(&w->buffer, number, sprintf(number, " %d", i));
+	if (!any)
+		BufferAppend(&w->buffer, " NONE", 5);
+	BufferAppend(&w->buffer, " LINE ", 6);
+	BufferAppend(&w->buffer, line, length);
+	BufferAppend(&w->buffer, "\n", 1);
+}
+
+// This function appends a match that ends after 'offset' bytes of input in scan mode
+void AppendMatch(ResultWriter * w, uint64_t offset) {
+	char number[32];
+	
+	w->counts[0]++;
+	if (w->mode == OUTPUT_COUNTS)
+		return;
+	
+	// Prefix is skipped when only accepted lines are printed
+	int length = sprintf(number, "%s%llu\n", w->mode == OUTPUT_ALL ? "MATCH END " : "", (unsigned long long) offset);
+	BufferAppend(&w->buffer, number, length);
+}
+
+// This function writes bytes to standard output with as few system calls as possible
+void WriteOutput(const char * data, size_t size) {
+	// Messages printed through stdio must go first
+	fflush(stdout);
+	
+#ifdef HAVE_UNISTD
+	while (size > 0) {
+		ssize_t written = write(STDOUT_FILENO, data, size);
+		if (written <= 0)
+			return;
+		data += written;
+		size -= written;
+	}
+#else
+	fwrite(data, 1, size, stdout);
+#endif
+}
+
+// This function writes buffered results to standard output and empties the buffer
+void FlushResults(ResultWriter * w) {
+	WriteOutput(w->buffer.data, w->buffer.length);
+	w->buffer.length = 0;
+}
+
+// This function writes results collected by another writer and adds up their counts
+void MergeResults(ResultWriter * w, ResultWriter * part) {
+	FlushResults(part);
+	w->counts[0] += part->counts[0];
+	w->counts[1] += part->counts[1];
+	w->counts[2] += part->counts[2];
+	part->counts[0] = part->counts[1] = part->counts[2] = 0;
+	
+	int i;
+	if (w->automataNum > 0)
+		for (i = 0; i <= w->automataNum; i++) {
+			w->acceptedBy[i] += part->acceptedBy[i];
+			part->acceptedBy[i] = 0;
+		}
+}
+
+// This function releases buffer of the writer, dropping results that were not written
+void FreeResults(ResultWriter * w) {
+	free(w->buffer.data);
+	free(w->acceptedBy);
+	w->buffer.data = NULL;
+	w->buffer.length = 0;
+	w->buffer.capacity = 0;
+	w->acceptedBy = NULL;
+}
+
+// This function writes the rest of results, prints counts if they were asked for
+// and releases the writer
+void FinishResults(ResultWriter * w) {
+	if (w->mode == OUTPUT_COUNTS && w->automataNum > 0) {
+		char counts[64];
+		int i;
+		
+		for (i = 0; i < w->automataNum; i++)
+			BufferAppend(&w->buffer, counts, sprintf(counts, "ACCEPTED BY %d %ld\n", i, w->acceptedBy[i]));
+		BufferAppend(&w->buffer, counts, sprintf(counts, "ACCEPTED BY NONE %ld\n", w->acceptedBy[w->automataNum]));
+	} else if (w->mode == OUTPUT_COUNTS && w->scan) {
+		char counts[64];
+		BufferAppend(&w->buffer, counts, sprintf(counts, "MATCHES %ld\n", w->counts[0]));
+	} else if (w->mode == OUTPUT_COUNTS) {
+		char counts[128];
+		int length = sprintf(counts, "ACCEPTED %ld\nREJECTED %ld\nWRONG SYMBOL %ld\n",
+			w->counts[0], w->counts[1], w->counts[2]);
+		BufferAppend(&w->buffer, counts, length);
+	}
+	
+	FlushResults(w);
+	FreeResults(w);
+}
+
+// This function processes every record of a buffer, records are separated by newlines
+// Empty records and comments are skipped the same way GetLine skips them.
+// Records are split out in batches and simulated together with ProcessRecordBatch or
+// ProcessSetBatch, huge records are split between 'threadsNum' threads by ProcessHugeRecord
+void ProcessBuffer(const Classifier * classifier, const char * data, size_t size, int threadsNum, ResultWriter * out) {
+	const CompiledAutomaton * c = classifier->automaton;
+	const AutomatonSet * set = classifier->set;
+	const char * starts[BATCH_RECORDS];
+	const char * ends[BATCH_RECORDS];
+	int results[BATCH_RECORDS];
+	uint64_t * accepted = NULL;
+	const char * end = data + size;
+	const char * cursor = data;
+	int i;
+	
+	if (set != NULL) {
+		accepted = (uint64_t *) malloc((size_t) BATCH_RECORDS * set->wordsNum * sizeof(uint64_t));
+		if (accepted == NULL) {
+			fprintf(stderr, "Not enough memory for results!\n");
+			return;
+		}
+	}
+	
+	while (cursor < end) {
+		const char * hugeRecord = NULL;
+		const char * hugeRecordEnd = NULL;
+		int recordsNum = 0;
+		
+		while (cursor < end && recordsNum < BATCH_RECORDS) {
+			const char * record = cursor;
+			const char * newline = (const char *) memchr(record, '\n', end - record);
+			const char * recordEnd = newline != NULL ? newline : end;
+			cursor = newline != NULL ? newline + 1 : end;
+			
+			if (record == recordEnd || *record == '#' || *record == '\0')
+				continue;
+			
+			// Batch ends before huge record to keep results in order
+			if (c != NULL && threadsNum > 1 && (size_t) (recordEnd - record) >= HUGE_RECORD_SIZE) {
+				hugeRecord = record;
+				hugeRecordEnd = recordEnd;
+				break;
+			}
+			
+			starts[recordsNum] = record;
+			ends[recordsNum] = recordEnd;
+			recordsNum++;
+		}
+		
+		if (set != NULL) {
+			ProcessSetBatch(set, starts, ends, recordsNum, accepted);
+			for (i = 0; i < recordsNum; i++)
+				AppendSetResult(out, accepted + (size_t) i * set->wordsNum, starts[i], ends[i] - starts[i]);
+			continue;
+		}
+		
+		if (classifier->lazyAutomaton != NULL) {
+			if (ProcessLazyBatch(classifier->lazyAutomaton, starts, ends, recordsNum, results)) {
+				fprintf(stderr, "Not enough memory for lazy automaton!\n");
+				break;
+			}
+		} else {
+			ProcessRecordBatch(c, starts, ends, recordsNum, results);
+		}
+		for (i = 0; i < recordsNum; i++)
+			AppendResult(out, results[i], starts[i], ends[i] - starts[i]);
+		
+		if (hugeRecord != NULL)
+			AppendResult(out, ProcessHugeRecord(c, hugeRecord, hugeRecordEnd, threadsNum),
+				hugeRecord, hugeRecordEnd - hugeRecord);
+	}
+	
+	free(accepted);
+}
+
+// This function returns end of chunk that starts at 'start': the first line end
+// after CHUNK_SIZE bytes or buffer end
+const char * ChunkEnd(const char * start, const char * end) {
+	if ((size_t) (end - start) <= CHUNK_SIZE)
+		return end;
+	
+	const char * newline = (const char *) memchr(start + CHUNK_SIZE, '\n', end - start - CHUNK_SIZE);
+	return newline != NULL ? newline + 1 : end;
+}
+
+// This function processes strings file line by line with stdio
+// Returns 0 on success, 1 on failure
+int ProcessStdioFile(const Classifier * classifier, const char * path, ResultWriter * out) {
+	FILE * f;
+	f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (f == NULL) {
+		printf("Cannot open strings file %s!\n", path);
+		return 1;
+	}
+	
+	// Process every string from this file
+	const AutomatonSet * set = classifier->set;
+	uint64_t * accepted = set != NULL ? (uint64_t *) malloc(set->wordsNum * sizeof(uint64_t)) : NULL;
+	if (set != NULL && accepted == NULL) {
+		fprintf(stderr, "Not enough memory for results!\n");
+		if (f != stdin)
+			fclose(f);
+		return 1;
+	}
+	
+	const char * line;
+	while ((line = GetLine(f)) != NULL) {
+		if (set != NULL) {
+			const char * lineEnd = line + strlen(line);
+			ProcessSetBatch(set, &line, &lineEnd, 1, accepted);
+			AppendSetResult(out, accepted, line, lineEnd - line);
+		} else if (classifier->lazyAutomaton != NULL) {
+			const char * lineEnd = line + strlen(line);
+			int res;
+			if (ProcessLazyBatch(classifier->lazyAutomaton, &line, &lineEnd, 1, &res)) {
+				fprintf(stderr, "Not enough memory for lazy automaton!\n");
+				break;
+			}
+			AppendResult(out, res, line, lineEnd - line);
+		} else {
+			AppendResult(out, ProcessString(classifier->automaton, line), line, strlen(line));
+		}
+		if (out->buffer.length >= CHUNK_SIZE)
+			FlushResults(out);
+	}
+	
+	free(accepted);
+	if (f != stdin)
+		fclose(f);
+	return 0;
+}
+
+#ifdef HAVE_THREADS
+// Slot for a chunk of input processed by a worker
+typedef struct {
+	// Formatted results of the chunk
+	ResultWriter out;
+	
+	// Set when results are ready to be written
+	int done;
+} ChunkSlot;
+
+// State shared by workers that classify chunks of one buffer
+typedef struct {
+	const Classifier * classifier;
+	
+	// Not yet assigned part of input
+	const char * cursor;
+	const char * end;
+	
+	// Huge record that workers stopped before, NULL if there is none. It is split between
+	// all threads once workers are done with input before it
+	const char * hugeRecord;
+	const char * hugeRecordEnd;
+	
+	// Ring of slots, chunk number n uses slot n % slotsNum
+	ChunkSlot * slots;
+	int slotsNum;
+	
+	// Number of chunks handed out to workers and number of chunks written
+	long assignedNum;
+	long writtenNum;
+	
+	pthread_mutex_t lock;
+	
+	// Signalled when a chunk is done and when a slot becomes free
+	pthread_cond_t chunkDone;
+	pthread_cond_t slotFree;
+} ChunkQueue;
+
+// Worker takes chunks in input order, processes them into their slots and tells writer about them
+void * ChunkWorker(void * arg) {
+	ChunkQueue * q = (ChunkQueue *) arg;
+	
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		// Do not run too far ahead of writer
+		while (q->cursor < q->end && q->assignedNum - q->writtenNum >= q->slotsNum)
+			pthread_cond_wait(&q->slotFree, &q->lock);
+		
+		if (q->cursor >= q->end)
+			break;
+		
+		const char * start = q->cursor;
+		const char * chunkEnd = ChunkEnd(start, q->end);
+		ChunkSlot * slot = &q->slots[q->assignedNum % q->slotsNum];
+		
+		// Only the last record of a chunk can be huge, it starts before CHUNK_SIZE bytes
+		if (q->classifier->automaton != NULL && (size_t) (chunkEnd - start) >= HUGE_RECORD_SIZE) {
+			const char * record = start + CHUNK_SIZE;
+			const char * recordEnd = chunkEnd[-1] == '\n' ? chunkEnd - 1 : chunkEnd;
+			while (record > start && record[-1] != '\n')
+				record--;
+			
+			if ((size_t) (recordEnd - record) >= HUGE_RECORD_SIZE) {
+				q->hugeRecord = record;
+				q->hugeRecordEnd = chunkEnd;
+				q->end = record;
+				chunkEnd = record;
+			}
+		}
+		q->cursor = chunkEnd;
+		q->assignedNum++;
+		pthread_mutex_unlock(&q->lock);
+		
+		// Huge records are left to ProcessBufferParallel, so workers never start threads
+		ProcessBuffer(q->classifier, start, chunkEnd - start, 1, &slot->out);
+		
+		pthread_mutex_lock(&q->lock);
+		slot->done = 1;
+		pthread_cond_signal(&q->chunkDone);
+	}
+	pthread_mutex_unlock(&q->lock);
+	
+	return NULL;
+}
+
+// This function processes buffer on 'threadsNum' workers and writes results in input order
+// Workers stop before a huge record, which is then split between 'threadsNum' threads by
+// ProcessHugeRecord, and go on after it
+// Returns 0 on success, 1 on failure
+int ProcessBufferParallel(const Classifier * classifier, const char * data, size_t size, int threadsNum, ResultWriter * out) {
+	ChunkQueue q;
+	int i;
+	
+	q.classifier = classifier;
+	q.cursor = data;
+	q.end = data + size;
+	q.slotsNum = threadsNum * CHUNKS_PER_WORKER;
+	q.assignedNum = 0;
+	q.writtenNum = 0;
+	q.slots = (ChunkSlot *) calloc(q.slotsNum, sizeof(ChunkSlot));
+	pthread_t * workers = (pthread_t *) malloc(threadsNum * sizeof(pthread_t));
+	if (q.slots == NULL || workers == NULL) {
+		free(q.slots);
+		free(workers);
+		return 1;
+	}
 	
-	printf("Symbols:     ");
-	for (i = 0; i < a->transitionsNum; i++)
-		printf("%c ", a->transitions[i]);
-	printf("\n");
+	int failed = 0;
+	for (i = 0; i < q.slotsNum; i++)
+		failed |= InitResults(&q.slots[i].out, out->mode, out->automataNum);
+	if (failed) {
+		for (i = 0; i < q.slotsNum; i++)
+			FreeResults(&q.slots[i].out);
+		free(q.slots);
+		free(workers);
+		return 1;
+	}
 	
-	printf("Transition table: -------------\n");
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.chunkDone, NULL);
+	pthread_cond_init(&q.slotFree, NULL);
 	
-	for (i = 0; i < a->statesNum; i++)
-		for (j = 0; j < a->statesNum; j++) {
-			int toIndex = a->transitionTable[i][j];
+	while (q.cursor < q.end) {
+		int workersNum = 0;
+		q.hugeRecord = NULL;
+		for (i = 0; i < threadsNum; i++)
+			if (pthread_create(&workers[workersNum], NULL, ChunkWorker, &q) == 0)
+				workersNum++;
+		
+		if (workersNum == 0) {
+			// No threads at all, do the work here
+			ProcessBuffer(classifier, q.cursor, q.end - q.cursor, 1, out);
+			FlushResults(out);
+			break;
+		}
+		
+		// Write chunks in input order as soon as they are done
+		pthread_mutex_lock(&q.lock);
+		for (;;) {
+			ChunkSlot * slot = &q.slots[q.writtenNum % q.slotsNum];
+			while (!slot->done && !(q.cursor >= q.end && q.writtenNum == q.assignedNum))
+				pthread_cond_wait(&q.chunkDone, &q.lock);
 			
-			if (toIndex == -1)
-				printf("%6s %c ??????\n", a->statesNames[i], a->transitions[j]);
-			else
-				printf("%6s %c %-6s\n", a->statesNames[i], a->transitions[j], a->statesNames[toIndex]);
+			if (!slot->done)
+				break;
+			pthread_mutex_unlock(&q.lock);
+			
+			MergeResults(out, &slot->out);
+			
+			pthread_mutex_lock(&q.lock);
+			slot->done = 0;
+			q.writtenNum++;
+			pthread_cond_broadcast(&q.slotFree);
+		}
+		pthread_mutex_unlock(&q.lock);
+		
+		for (i = 0; i < workersNum; i++)
+			pthread_join(workers[i], NULL);
+		
+		// Workers are gone, so the huge record gets every thread
+		if (q.hugeRecord != NULL) {
+			ProcessBuffer(classifier, q.hugeRecord, q.hugeRecordEnd - q.hugeRecord, threadsNum, out);
+			FlushResults(out);
+			q.cursor = q.hugeRecordEnd;
+			q.end = data + size;
 		}
+	}
+	
+	for (i = 0; i < q.slotsNum; i++)
+		FreeResults(&q.slots[i].out);
+	free(q.slots);
+	free(workers);
+	pthread_mutex_destroy(&q.lock);
+	pthread_cond_destroy(&q.chunkDone);
+	pthread_cond_destroy(&q.slotFree);
+	
+	return 0;
 }
+#endif
 
-// Process string using automaton. Possible results:
-// 0 - ACCEPTED
-// 1 - REJECTED
-// 2 - Found wrong symbol
-int ProcessString(Automaton * a, const char * string) {
-	int len = strlen(string);
-	int i;
+#ifdef HAVE_MMAP
+// This function maps opened strings file into memory and runs automaton directly over its bytes
+// Input is split at line ends into chunks that are processed on 'threadsNum' threads
+// Returns 0 on success, 1 on failure and -1 if file cannot be mapped (e.g. it is a pipe)
+int ProcessMappedFile(const Classifier * classifier, int fd, int threadsNum, ResultWriter * out) {
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+		return -1;
 	
-	// Check if every symbol belongs to automaton symbol set
-	for (i = 0; i < len; i++)
-		if (TransitionToIdx(a, string[i]) == -1)
-			return 2;
+	// Empty file has nothing to process and cannot be mapped
+	size_t size = (size_t) st.st_size;
+	if (size == 0)
+		return 0;
+	
+	void * data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return -1;
+	
+	// Strings are read once from start to end
+	madvise(data, size, MADV_SEQUENTIAL);
+	
+	int res = 0;
+#ifdef HAVE_THREADS
+	// Small inputs are not worth starting threads
+	if (threadsNum > 1 && size > CHUNK_SIZE)
+		res = ProcessBufferParallel(classifier, (const char *) data, size, threadsNum, out);
+	else
+#endif
+	{
+		const char * cursor = (const char *) data;
+		const char * end = cursor + size;
+		
+		while (cursor < end) {
+			const char * chunkEnd = ChunkEnd(cursor, end);
+			ProcessBuffer(classifier, cursor, chunkEnd - cursor, threadsNum, out);
+			FlushResults(out);
+			cursor = chunkEnd;
+		}
+	}
+	
+	munmap(data, size);
+	return res;
+}
+#endif
+
+#ifdef HAVE_UNISTD
+// This function reads records from file descriptor as they arrive, e.g. from a pipe
+// Every complete record is processed right after it is read. With 'streaming' set, results
+// are written after every read, otherwise they are collected into large blocks
+// Returns 0 on success, 1 on failure
+int ProcessStream(const Classifier * classifier, int fd, int threadsNum, int streaming, ResultWriter * out) {
+	ByteBuffer in = { NULL, 0, 0 };
+	int res = 0;
+	
+	for (;;) {
+		// Keep room for a large read, the buffer also grows to fit records of any length
+		if (BufferReserve(&in, CHUNK_SIZE)) {
+			fprintf(stderr, "Not enough memory for input buffer!\n");
+			res = 1;
+			break;
+		}
+		
+		ssize_t got = read(fd, in.data + in.length, in.capacity - in.length);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0) {
+			fprintf(stderr, "Cannot read strings: %s\n", strerror(errno));
+			res = 1;
+			break;
+		}
+		
+		// Input has ended, the last record may have no newline
+		if (got == 0) {
+			ProcessBuffer(classifier, in.data, in.length, threadsNum, out);
+			break;
+		}
+		
+		// Only new bytes may hold the last line end
+		size_t scanned = in.length;
+		in.length += got;
+		size_t complete = in.length;
+		while (complete > scanned && in.data[complete - 1] != '\n')
+			complete--;
+		
+		if (complete > scanned) {
+			ProcessBuffer(classifier, in.data, complete, threadsNum, out);
+			memmove(in.data, in.data + complete, in.length - complete);
+			in.length -= complete;
+		}
+		
+		if (streaming || out->buffer.length >= CHUNK_SIZE)
+			FlushResults(out);
+	}
+	
+	free(in.data);
+	return res;
+}
+#endif
+
+// This function processes strings file, or standard input when path is "-"
+// Regular files are mapped into memory when possible, other inputs are read as a stream
+// Returns 0 on success, 1 on failure
+int ProcessInput(const Classifier * classifier, const char * path, int threadsNum, int streaming, ResultWriter * out) {
+#ifdef HAVE_UNISTD
+	int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+	if (fd == -1) {
+		printf("Cannot open strings file %s!\n", path);
+		return 1;
+	}
+	
+	int res = -1;
+	if (!streaming)
+		res = ProcessMappedFile(classifier, fd, threadsNum, out);
+	if (res == -1)
+		res = ProcessStream(classifier, fd, threadsNum, streaming, out);
 	
-	// Start simulation
-	int currentState = a->startStateIndex;
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return res;
+#else
+	(void) threadsNum;
+	(void) streaming;
+	return ProcessStdioFile(classifier, path, out);
+#endif
+}
+
+// Scan engine: runs a block of input from 'state' over automaton made by AddScanPrefix, which
+// has neither dead nor wrong symbol states, and reports every byte that ends in finishing state.
+// 'offset' is number of bytes before the block. Returns the state block ends in
+#define DEFINE_SCAN_BLOCK(NAME, TYPE) \
+size_t NAME(const CompiledAutomaton * c, size_t state, const unsigned char * str, \
+	const unsigned char * end, uint64_t offset, ResultWriter * out) { \
+	const TYPE * table = (const TYPE *) c->table; \
+	const uint8_t * byteClass = c->byteClass; \
+	const uint8_t * finishBits = c->finishBits; \
+	int rowShift = c->rowShift; \
+	const unsigned char * start = str; \
+	\
+	while (str < end) { \
+		state = table[(state << rowShift) + byteClass[*str++]]; \
+		if (finishBits[state >> 3] & (1 << (state & 7))) \
+			AppendMatch(out, offset + (str - start)); \
+	} \
+	\
+	return state; \
+}
+
+DEFINE_SCAN_BLOCK(ScanBlock8, uint8_t)
+DEFINE_SCAN_BLOCK(ScanBlock16, uint16_t)
+DEFINE_SCAN_BLOCK(ScanBlock32, uint32_t)
+
+// This function scans a block of input with the engine of table width
+// Returns the state block ends in
+size_t ScanBlock(const CompiledAutomaton * c, size_t state, const unsigned char * str,
+	const unsigned char * end, uint64_t offset, ResultWriter * out) {
+	switch (c->stateWidth) {
+		case 1:
+		return ScanBlock8(c, state, str, end, offset, out);
+		
+		case 2:
+		return ScanBlock16(c, state, str, end, offset, out);
+		
+		default:
+		return ScanBlock32(c, state, str, end, offset, out);
+	}
+}
+
+// This function scans a block of input like ScanBlock over states of lazily built automaton,
+// the states are sets of states of nondeterministic automaton with scan prefix
+// Returns the state block ends in, -1 if memory ran out
+int ScanLazyBlock(LazyCache * z, int state, const unsigned char * str, const unsigned char * end,
+	uint64_t offset, ResultWriter * out) {
+	const unsigned char * start = str;
+	
+	while (str < end) {
+		int byteClass = z->byteClass[*str++];
+		int next = z->table[(size_t) state * z->classesNum + byteClass];
+		
+		state = next != -1 ? next : LazyNext(z, state, byteClass);
+		if (state == -1)
+			return -1;
+		if (z->accepted[(size_t) state * z->acceptWords] & 1)
+			AppendMatch(out, offset + (str - start));
+	}
+	
+	z->bytesSinceFlush += end - start;
+	return state;
+}
+
+// This function scans strings file, or standard input when path is "-", as one stream of bytes
+// where line ends are bytes like the others, and reports the end of every match. With
+// 'streaming' set, matches are written after every read
+// Returns 0 on success, 1 on failure
+int ScanInput(const Classifier * classifier, const char * path, int streaming, ResultWriter * out) {
+	const CompiledAutomaton * c = classifier->automaton;
+	LazyCache * z = NULL;
+	size_t state = 0;
+	uint64_t offset = 0;
+	int res = 0;
+	
+#ifdef HAVE_UNISTD
+	int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+	if (fd == -1) {
+#else
+	FILE * f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+	if (f == NULL) {
+#endif
+		printf("Cannot open strings file %s!\n", path);
+		return 1;
+	}
+	
+	unsigned char * block = (unsigned char *) malloc(CHUNK_SIZE);
+	if (classifier->lazyAutomaton != NULL) {
+		z = TakeLazyCache(classifier->lazyAutomaton);
+		if (z != NULL)
+			state = z->startState;
+	} else {
+		state = c->startState;
+	}
+	
+	if (block == NULL || (classifier->lazyAutomaton != NULL && z == NULL)) {
+		fprintf(stderr, "Not enough memory for scanning!\n");
+		res = 1;
+	}
+	
+	while (res == 0) {
+#ifdef HAVE_UNISTD
+		ssize_t got = read(fd, block, CHUNK_SIZE);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0) {
+			fprintf(stderr, "Cannot read strings: %s\n", strerror(errno));
+			res = 1;
+			break;
+		}
+#else
+		size_t got = fread(block, 1, CHUNK_SIZE, f);
+#endif
+		if (got == 0)
+			break;
+		
+		if (z != NULL) {
+			int lazyState = ScanLazyBlock(z, (int) state, block, block + got, offset, out);
+			if (lazyState == -1) {
+				fprintf(stderr, "Not enough memory for scanning!\n");
+				res = 1;
+				break;
+			}
+			state = (size_t) lazyState;
+		} else
+			state = ScanBlock(c, state, block, block + got, offset, out);
+		offset += got;
+		
+		if (streaming || out->buffer.length >= CHUNK_SIZE)
+			FlushResults(out);
+	}
+	
+	if (z != NULL)
+		ReturnLazyCache(classifier->lazyAutomaton, z);
+	free(block);
+#ifdef HAVE_UNISTD
+	if (fd != STDIN_FILENO)
+		close(fd);
+#else
+	if (f != stdin)
+		fclose(f);
+#endif
+	return res;
+}
+
+// This function turns loaded automaton into execution form: it is pruned, minimized if
+// 'minimize' is set, given a column for every byte if its symbols stand for classes of bytes
+// told by 'byteSymbol' (NULL otherwise) and compiled. Loaded automaton is released, also on failure
+// Returns 0 on success, 1 on failure
+int PrepareAutomaton(Automaton * a, int minimize, const int * byteSymbol, CompiledAutomaton * c) {
+	// Drop states that cannot affect results
+	Automaton pruned;
+	int * pruneMap = (int *) malloc((a->statesNum + 1) * sizeof(int));
+	if (pruneMap == NULL || PruneAutomaton(a, &pruned, pruneMap)) {
+		fprintf(stderr, "Could not prune automation.\n");
+		free(pruneMap);
+		FreeAutomaton(a);
+		return 1;
+	}
+	free(pruneMap);
+	FreeAutomaton(a);
+	*a = pruned;
 	
-	// Cycle through whole string
-	for (i = 0; i < len; i++) {
-		int curSymbolIdx = TransitionToIdx(a, string[i]);
+	if (minimize) {
+		Automaton minimal;
 		
-		int nextState = a->transitionTable[currentState][curSymbolIdx];
+		if (MinimizeAutomaton(a, &minimal)) {
+			fprintf(stderr, "Could not minimize automation.\n");
+			FreeAutomaton(a);
+			return 1;
+		}
+		
+		FreeAutomaton(a);
+		*a = minimal;
+	}
+	
+	if (byteSymbol != NULL) {
+		Automaton expanded;
 		
-		if (nextState == -1 || nextState >= a->statesNum) {
-			// We found that there is no jump with this symbol from this vertex
-			// It may be handled differenty, but we'll throw it as a rejected string
+		if (ExpandSymbols(a, byteSymbol, &expanded)) {
+			fprintf(stderr, "Could not expand symbols of automation.\n");
+			FreeAutomaton(a);
 			return 1;
 		}
 		
-		currentState = nextState;
+		FreeAutomaton(a);
+		*a = expanded;
+	}
+	
+	// Debug print
+	// PrintAutomaton(a);
+	
+	if (CompileAutomaton(a, c)) {
+		fprintf(stderr, "Could not compile automation.\n");
+		FreeAutomaton(a);
+		return 1;
 	}
 	
-	// Check if our state is finish state
-	if (a->finishState[currentState])
+	// Simulation only needs execution form
+	FreeAutomaton(a);
+	return 0;
+}
+
+// This function loads automaton from text or binary file into its execution form.
+// Text files hold nondeterministic automata when 'nfa' is set, they are made deterministic.
+// With 'scan' set the automaton is made to find matches anywhere in input, see AddScanPrefix.
+// Automata from text files are pruned, minimized if 'minimize' or 'scan' is set and compiled
+// Returns 0 on success, 1 on failure
+int LoadAutomatonFile(CompiledAutomaton * c, const char * path, int minimize, int nfa, int scan) {
+	if (IsCompiledAutomatonFile(path)) {
+		if (scan) {
+			fprintf(stderr, "Scan mode needs automaton in text form!\n");
+			return 1;
+		}
+		
+		// Binary file is ready to use
+		if (LoadCompiledAutomaton(c, path, 0)) {
+			fprintf(stderr, "Could not load automation.\n");
+			return 1;
+		}
 		return 0;
-	else
+	}
+	
+	Automaton a;
+	
+	if (nfa || scan) {
+		int byteSymbol[256];
+		Nfa n;
+		
+		if (LoadNfa(&n, path)) {
+			fprintf(stderr, "Could not load automation.\n");
+			FreeNfa(&n);
+			return 1;
+		}
+		
+		int res = scan && AddScanPrefix(&n);
+		if (!res)
+			res = DeterminizeNfa(&n, &a);
+		memcpy(byteSymbol, n.byteSymbol, sizeof(byteSymbol));
+		FreeNfa(&n);
+		if (res) {
+			fprintf(stderr, "Could not make automation deterministic.\n");
+			return 1;
+		}
+		
+		// Symbol of scan automaton that stands for bytes out of the symbol set is expanded
+		if (scan)
+			return PrepareAutomaton(&a, 1, byteSymbol, c);
+	} else if (LoadAutomaton(&a, path)) {
+		fprintf(stderr, "Could not load automation.\n");
 		return 1;
+	}
+	
+	return PrepareAutomaton(&a, minimize, NULL, c);
 }
 
-// Main function
-int main() {
-	// Ask for file paths
-	char automatonPath[MAX_LINE_LENGTH], stringPath[MAX_LINE_LENGTH];
-	printf("Enter automaton file path: ");
-	scanf("%s", automatonPath);
+// This function compiles regular expression into execution form: automaton of the expression
+// is made deterministic, minimized and compiled. Unless 'cacheDir' is NULL, compiled automaton
+// is saved there under hash of the expression and later runs load it instead of compiling.
+// Cached file keeps the expression with syntax version and mode and is used only if they
+// are the same.
+// With 'scan' set the automaton is made to find matches anywhere in input, see AddScanPrefix
+// Returns 0 on success, 1 on failure
+int LoadRegex(CompiledAutomaton * c, const char * regex, const char * cacheDir, int scan) {
+	char cachePath[MAX_LINE_LENGTH];
+	char tempPath[MAX_LINE_LENGTH + 32];
 	
-	printf("Enter strings file path:   ");
-	scanf("%s", stringPath);
+	// Expression is kept and hashed together with syntax version and mode
+	char prefix[32];
+	sprintf(prefix, "%d %s ", REGEX_SYNTAX_VERSION, scan ? "scan" : "match");
+	size_t sourceSize = strlen(prefix) + strlen(regex);
+	char * source = (char *) malloc(sourceSize + 1);
+	if (source == NULL) {
+		fprintf(stderr, "Not enough memory for regular expression!\n");
+		return 1;
+	}
+	sprintf(source, "%s%s", prefix, regex);
+	
+	if (cacheDir != NULL) {
+		// Files of other layout versions are not looked at
+		uint64_t hash = 14695981039346656037ull ^ BINARY_VERSION;
+		size_t i;
+		for (i = 0; i < sourceSize; i++)
+			hash = (hash ^ (unsigned char) source[i]) * 1099511628211ull;
+		
+		snprintf(cachePath, sizeof(cachePath), "%s/dfsm-%08lx%08lx.bin", cacheDir,
+			(unsigned long) (hash >> 32), (unsigned long) (hash & 0xffffffffu));
+		if (LoadCompiledAutomaton(c, cachePath, 1) == 0) {
+			// Other expression with the same hash is compiled again and replaces it
+			if (c->sourceSize == sourceSize && memcmp(c->source, source, sourceSize) == 0) {
+				free(source);
+				return 0;
+			}
+			FreeCompiledAutomaton(c);
+		}
+	}
 	
+	Nfa n;
 	Automaton a;
 	
-	if (LoadAutomaton(&a, automatonPath)) {
-		fprintf(stderr, "Could not load automation.\n");
+	if (RegexToNfa(regex, &n, scan) || (scan && AddScanPrefix(&n))) {
+		FreeNfa(&n);
+		free(source);
 		return 1;
 	}
 	
-	// Debug print
-	// PrintAutomaton(&a);
+	int res = DeterminizeNfa(&n, &a);
+	if (res)
+		fprintf(stderr, "Could not make automation deterministic.\n");
+	else
+		res = PrepareAutomaton(&a, 1, n.byteSymbol, c);
+	FreeNfa(&n);
+	if (res) {
+		free(source);
+		return 1;
+	}
 	
-	// Open a file
-	FILE * f;
-	f = fopen(stringPath, "r");
+	// Automaton is written under other name first, so no one loads a part of it
+	if (cacheDir != NULL) {
+		c->source = source;
+		c->sourceSize = sourceSize;
+		FILE * f;
+#ifdef HAVE_UNISTD
+		// Cache directory may be shared, so the file gets a name no one can guess and is created
+		// only if nothing is there, readable by the user alone
+		snprintf(tempPath, sizeof(tempPath), "%s.XXXXXX", cachePath);
+		int fd = mkstemp(tempPath);
+		f = fd != -1 ? fdopen(fd, "wb") : NULL;
+		if (fd != -1 && f == NULL) {
+			close(fd);
+			remove(tempPath);
+		}
+#else
+		snprintf(tempPath, sizeof(tempPath), "%s.new", cachePath);
+		f = fopen(tempPath, "wb");
+#endif
+		if (f == NULL || WriteCompiledAutomaton(c, f) || rename(tempPath, cachePath) != 0) {
+			fprintf(stderr, "Could not cache compiled regular expression in %s\n", cacheDir);
+			if (f != NULL)
+				remove(tempPath);
+		}
+		c->source = NULL;
+		c->sourceSize = 0;
+	}
+	
+	free(source);
+	return 0;
+}
+
+// This function releases every automaton of a set
+void FreeAutomatonSet(AutomatonSet * set) {
+	int k;
+	
+	for (k = 0; k < set->automataNum; k++)
+		FreeCompiledAutomaton(&set->automata[k]);
+	free(set->automata);
+	free(set->productTable);
+	free(set->productAccepted);
+	FreeLazyPool(set->lazyProduct);
+	memset(set, 0, sizeof(*set));
+}
+
+// This function loads every automaton listed in a file, one path per line, to classify
+// records together. Small sets get product automaton. Listed text files hold nondeterministic
+// automata when 'nfa' is set
+// Returns 0 on success, 1 on failure
+int LoadAutomatonSet(AutomatonSet * set, const char * listPath, int minimize, int native, int nfa) {
+	char path[MAX_LINE_LENGTH];
+	int capacity = 0;
+	const char * line;
+	int failed = 0;
+	
+	memset(set, 0, sizeof(*set));
+	FILE * f = fopen(listPath, "r");
 	if (f == NULL) {
-		printf("Cannot open strings file %s!\n", stringPath);
+		fprintf(stderr, "File not found or could not be opened: %s\n", listPath);
 		return 1;
 	}
 	
-	// Process every string from this file
-	const char * line;
-	while ((line = GetLine(f)) != NULL) {
-		int res = ProcessString(&a, line);
-		switch (res) {
-			case 0:
-			printf("ACCEPTED LINE %s\n", line);
-			break;
-			
-			case 1:
-			printf("REJECTED LINE %s\n", line);
-			break;
-			
-			case 2:
-			printf("WRONG SYMBOL: %s\n", line);
+	while (!failed && (line = GetLine(f)) != NULL) {
+		// Line buffer is reused while automaton is loaded
+		if (strlen(line) >= sizeof(path)) {
+			fprintf(stderr, "Automaton path is too long in %s\n", listPath);
+			failed = 1;
 			break;
-			
-			case 3:
-			printf("UNKNOWN ERROR %s\n", line);
+		}
+		strcpy(path, line);
+		
+		if (set->automataNum == capacity) {
+			int newCapacity = capacity == 0 ? 16 : capacity * 2;
+			CompiledAutomaton * newAutomata = (CompiledAutomaton *) realloc(set->automata, newCapacity * sizeof(CompiledAutomaton));
+			if (newAutomata == NULL) {
+				fprintf(stderr, "Not enough memory for automata!\n");
+				failed = 1;
+				break;
+			}
+			set->automata = newAutomata;
+			capacity = newCapacity;
+		}
+		
+		if (LoadAutomatonFile(&set->automata[set->automataNum], path, minimize, nfa, 0)) {
+			fprintf(stderr, "Could not load automaton %s listed in %s\n", path, listPath);
+			failed = 1;
 			break;
 		}
+		set->automataNum++;
 	}
 	
+	if (!failed && ferror(f)) {
+		fprintf(stderr, "Cannot read %s\n", listPath);
+		failed = 1;
+	}
 	fclose(f);
+	if (!failed && set->automataNum == 0) {
+		fprintf(stderr, "No automata are listed in %s\n", listPath);
+		failed = 1;
+	}
+	if (failed) {
+		FreeAutomatonSet(set);
+		return 1;
+	}
+	
+	// Native code refers to automaton structure, so it is made once the array stops moving
+	int k;
+	for (k = 0; k < set->automataNum && native; k++) {
+#ifdef HAVE_JIT
+		if (CompileNative(&set->automata[k]))
+			fprintf(stderr, "Could not compile automaton %d into native code, tables are used\n", k);
+#else
+		fprintf(stderr, "Native code is not supported on this system, tables are used\n");
+		break;
+#endif
+	}
+	
+	// Product that is too large to be built at once is built lazily
+	set->wordsNum = (set->automataNum + 63) / 64;
+	BuildProductClasses(set);
+	if (BuildProduct(set) && BuildLazyProduct(set)) {
+		FreeAutomatonSet(set);
+		fprintf(stderr, "Not enough memory for product of automata!\n");
+		return 1;
+	}
+	return 0;
+}
+
+// This function prints command line help
+void PrintUsage(const char * program) {
+	fprintf(stderr,
+		"Usage: %s [options] automaton [strings]\n"
+		"Classifies every line of strings file (or standard input if it is '-' or omitted)\n"
+		"Without arguments file paths are asked interactively\n"
+		"Options:\n"
+		"  -o all|accepted|counts  print every result (default), only accepted lines\n"
+		"                          or only number of results of each kind\n"
+		"  -t N                    number of worker threads (default: number of processors)\n"
+		"  -s                      streaming mode: print results as soon as lines arrive\n"
+		"  -m                      minimize automaton before simulation\n"
+		"  -c FILE                 save compiled automaton to binary FILE and exit,\n"
+		"                          such file can be given instead of automaton later\n"
+		"  -g FILE                 write compiled automaton as C header FILE and exit\n"
+		"  -b                      use automaton built into the program from such header,\n"
+		"                          automaton argument is omitted then\n"
+		"  -j                      compile automaton into native code (x86-64)\n"
+		"  -a LIST                 classify by every automaton listed in LIST, one path per line,\n"
+		"                          and print indexes of accepting ones; automaton argument is omitted\n"
+		"  -n                      automaton files hold nondeterministic automata, transitions\n"
+		"                          with symbol eps read no input\n"
+		"  -l                      like -n, but deterministic states are built only when input\n"
+		"                          reaches them, for automata too large to make deterministic\n"
+		"  -r REGEX                classify by regular expression instead of automaton file, lines\n"
+		"                          that have a match are accepted; automaton argument is omitted\n"
+		"  -C DIR                  directory to cache compiled regular expressions in\n"
+		"                          (default: TMPDIR or /tmp), '-' turns caching off\n"
+		"  -S                      scan mode: input is one stream, print offset of end of every\n"
+		"                          match of automaton or regular expression in it\n"
+		"  -h                      show this help\n",
+		program);
+}
+
+// Main function
+int main(int argc, char * argv[]) {
+	int outputMode = OUTPUT_ALL;
+	int threadsNum = 0;
+	int streaming = 0;
+	int minimize = 0;
+	const char * automatonPath = NULL;
+	const char * stringPath = NULL;
+	const char * binaryPath = NULL;
+	const char * headerPath = NULL;
+	int builtin = 0;
+	int native = 0;
+	const char * listPath = NULL;
+	int nfa = 0;
+	int lazy = 0;
+	const char * regex = NULL;
+	const char * cacheDir = NULL;
+	int scan = 0;
+	int i;
+	
+	SelectVectorCode();
+	
+	// Parse command line
+	for (i = 1; i < argc; i++) {
+		const char * arg = argv[i];
+		
+		if (strcmp(arg, "-o") == 0 && i + 1 < argc) {
+			const char * mode = argv[++i];
+			if (strcmp(mode, "all") == 0)
+				outputMode = OUTPUT_ALL;
+			else if (strcmp(mode, "accepted") == 0)
+				outputMode = OUTPUT_ACCEPTED;
+			else if (strcmp(mode, "counts") == 0)
+				outputMode = OUTPUT_COUNTS;
+			else {
+				fprintf(stderr, "Unknown output mode %s, expected all, accepted or counts\n", mode);
+				return 1;
+			}
+		} else if (strcmp(arg, "-t") == 0 && i + 1 < argc) {
+			threadsNum = atoi(argv[++i]);
+			if (threadsNum < 1) {
+				fprintf(stderr, "Number of threads must be positive: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (strcmp(arg, "-s") == 0) {
+			streaming = 1;
+		} else if (strcmp(arg, "-m") == 0) {
+			minimize = 1;
+		} else if (strcmp(arg, "-c") == 0 && i + 1 < argc) {
+			binaryPath = argv[++i];
+		} else if (strcmp(arg, "-g") == 0 && i + 1 < argc) {
+			headerPath = argv[++i];
+		} else if (strcmp(arg, "-b") == 0) {
+			builtin = 1;
+		} else if (strcmp(arg, "-j") == 0) {
+			native = 1;
+		} else if (strcmp(arg, "-a") == 0 && i + 1 < argc) {
+			listPath = argv[++i];
+		} else if (strcmp(arg, "-n") == 0) {
+			nfa = 1;
+		} else if (strcmp(arg, "-l") == 0) {
+			nfa = 1;
+			lazy = 1;
+		} else if (strcmp(arg, "-r") == 0 && i + 1 < argc) {
+			regex = argv[++i];
+		} else if (strcmp(arg, "-C") == 0 && i + 1 < argc) {
+			cacheDir = argv[++i];
+		} else if (strcmp(arg, "-S") == 0) {
+			scan = 1;
+		} else if (strcmp(arg, "-h") == 0) {
+			PrintUsage(argv[0]);
+			return 0;
+		} else if (arg[0] == '-' && arg[1] != '\0') {
+			PrintUsage(argv[0]);
+			return 1;
+		} else if (automatonPath == NULL) {
+			automatonPath = arg;
+		} else if (stringPath == NULL) {
+			stringPath = arg;
+		} else {
+			PrintUsage(argv[0]);
+			return 1;
+		}
+	}
+	
+	// Lazily built automaton has no tables to save, compile or share
+	if (lazy && (minimize || binaryPath != NULL || headerPath != NULL || builtin || native || listPath != NULL)) {
+		PrintUsage(argv[0]);
+		return 1;
+	}
+	
+	// Scan automaton is run by its own engine
+	if (scan && (binaryPath != NULL || headerPath != NULL || builtin || native || listPath != NULL)) {
+		PrintUsage(argv[0]);
+		return 1;
+	}
+	
+	// Regular expression is the automaton, the only file is strings file
+	if (regex != NULL && (builtin || listPath != NULL || (nfa && !lazy))) {
+		PrintUsage(argv[0]);
+		return 1;
+	}
+	
+	// Compiled regular expressions are cached in temporary directory unless told otherwise
+	if (cacheDir == NULL) {
+		cacheDir = getenv("TMPDIR") != NULL && getenv("TMPDIR")[0] != '\0' ? getenv("TMPDIR") : "/tmp";
+#ifndef HAVE_UNISTD
+		cacheDir = NULL;
+#endif
+	} else if (strcmp(cacheDir, "-") == 0) {
+		cacheDir = NULL;
+	}
+	
+	char automatonPathBuf[MAX_LINE_LENGTH], stringPathBuf[MAX_LINE_LENGTH];
+	if (builtin || listPath != NULL || regex != NULL) {
+		// The only path is strings file
+		if (stringPath != NULL || (builtin && listPath != NULL)
+			|| (listPath != NULL && (binaryPath != NULL || headerPath != NULL))) {
+			PrintUsage(argv[0]);
+			return 1;
+		}
+		stringPath = automatonPath != NULL ? automatonPath : "-";
+		automatonPath = builtin ? "built-in automaton" : listPath != NULL ? listPath : regex;
+	} else if (automatonPath == NULL && (binaryPath != NULL || headerPath != NULL)) {
+		PrintUsage(argv[0]);
+		return 1;
+	}
+	
+	if (automatonPath == NULL) {
+		// Ask for file paths
+		printf("Enter automaton file path: ");
+		if (scanf("%4095s", automatonPathBuf) != 1)
+			return 1;
+		
+		printf("Enter strings file path:   ");
+		if (scanf("%4095s", stringPathBuf) != 1)
+			return 1;
+		
+		automatonPath = automatonPathBuf;
+		stringPath = stringPathBuf;
+	} else if (stringPath == NULL) {
+		stringPath = "-";
+	}
+	
+	CompiledAutomaton c;
+	AutomatonSet set;
+	Nfa n;
+	Classifier classifier = { NULL, NULL, NULL };
+	
+	if (lazy) {
+		if (regex != NULL ? RegexToNfa(regex, &n, scan) : LoadNfa(&n, automatonPath)) {
+			fprintf(stderr, "Could not load automation.\n");
+			return 1;
+		}
+		
+		if (scan && AddScanPrefix(&n)) {
+			fprintf(stderr, "Not enough memory for scan automaton!\n");
+			return 1;
+		}
+		
+		classifier.lazyAutomaton = BuildLazyNfa(&n);
+		if (classifier.lazyAutomaton == NULL) {
+			fprintf(stderr, "Not enough memory for lazy automaton!\n");
+			return 1;
+		}
+	} else if (listPath != NULL) {
+		if (LoadAutomatonSet(&set, listPath, minimize, native, nfa)) {
+			fprintf(stderr, "Could not load automata.\n");
+			return 1;
+		}
+		classifier.set = &set;
+	} else {
+		if (builtin) {
+#ifdef DFSM_BUILTIN_HEADER
+			if (InitBuiltinAutomaton(&c))
+				return 1;
+#else
+			fprintf(stderr, "No automaton is built into this program, compile it with DFSM_BUILTIN_HEADER\n");
+			return 1;
+#endif
+		} else if (regex != NULL) {
+			if (LoadRegex(&c, regex, cacheDir, scan))
+				return 1;
+		} else if (LoadAutomatonFile(&c, automatonPath, minimize, nfa, scan)) {
+			return 1;
+		}
+		
+		if (binaryPath != NULL)
+			return SaveCompiledAutomaton(&c, binaryPath);
+		if (headerPath != NULL)
+			return GenerateAutomatonHeader(&c, regex != NULL ? "made of regular expression" : automatonPath, headerPath);
+		
+		// Tables stay in use when native code cannot be made
+		if (native) {
+#ifdef HAVE_JIT
+			if (CompileNative(&c))
+				fprintf(stderr, "Could not compile automaton into native code, tables are used\n");
+#else
+			fprintf(stderr, "Native code is not supported on this system, tables are used\n");
+#endif
+		}
+		classifier.automaton = &c;
+	}
+	
+	// By default use every processor for classification
+	if (threadsNum == 0) {
+		threadsNum = 1;
+#ifdef HAVE_THREADS
+		threadsNum = (int) sysconf(_SC_NPROCESSORS_ONLN);
+		if (threadsNum < 1)
+			threadsNum = 1;
+#endif
+	}
+	
+	ResultWriter out;
+	if (InitResults(&out, outputMode, listPath != NULL ? set.automataNum : 0)) {
+		fprintf(stderr, "Not enough memory for results!\n");
+		return 1;
+	}
+	
+	out.scan = scan;
+	int res = scan ? ScanInput(&classifier, stringPath, streaming, &out)
+		: ProcessInput(&classifier, stringPath, threadsNum, streaming, &out);
+	FinishResults(&out);
+	if (res)
+		return 1;
 	
-	// Actually, there is no need to free automaton resources because there is only one automaton
+	// Actually, there is no need to free compiled automaton resources because there is only one automaton
 	// that would be automatically unloaded anyway when application is terminated
 	
 	return 0;